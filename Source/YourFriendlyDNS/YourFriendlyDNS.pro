@@ -72,7 +72,16 @@ SOURCES += \
     messagesthread.cpp \
     cacheviewer.cpp \
     dnscrypt.cpp \
-    providersourcerstampconverter.cpp
+    providersourcerstampconverter.cpp \
+    dnscache.cpp \
+    listmatcher.cpp \
+    pendingqueries.cpp \
+    keypairpool.cpp \
+    upstreamconnections.cpp \
+    http2client.cpp \
+    httpresponseparser.cpp \
+    bootstrapresolver.cpp \
+    providerregistry.cpp
 
 HEADERS += \
         dnsserverwindow.h \
@@ -87,7 +96,16 @@ HEADERS += \
     dnsinfo.h \
     dnscrypt.h \
     buffer.h \
-    providersourcerstampconverter.h
+    providersourcerstampconverter.h \
+    dnscache.h \
+    listmatcher.h \
+    pendingqueries.h \
+    keypairpool.h \
+    upstreamconnections.h \
+    http2client.h \
+    httpresponseparser.h \
+    bootstrapresolver.h \
+    providerregistry.h
 
 FORMS += \
         dnsserverwindow.ui \
@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# DNSCache lookup micro-benchmark, not part of the app's build:
+# qmake && make in this directory, then run ./cachebench
+#
+#-------------------------------------------------
+
+QT       += core network
+QT       -= gui
+
+CONFIG += c++14 console
+CONFIG -= app_bundle
+
+TARGET = cachebench
+TEMPLATE = app
+
+DEFINES += QT_NO_DEBUG_OUTPUT
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+        main.cpp \
+    ../../dnscache.cpp
+
+HEADERS += \
+    ../../dnscache.h \
+    ../../dnsinfo.h
@@ -0,0 +1,109 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <vector>
+#include "dnscache.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+//How long a lookup takes as the cache grows: the same number of lookups, hits and misses timed separately,
+//against 1k, 10k, 100k and 1M cached names. With the hash index both should stay flat, the old linear scan grew with every name.
+//There's no memory budget here (nothing's evicted), so at 1M it needs a few hundred MB.
+
+#define BENCH_LOOKUPS (1 << 20)
+
+static QString benchName(quint32 i)
+{
+    return QString("host%1.example.com").arg(i);
+}
+
+static DNSInfo benchEntry(const QString &domain)
+{
+    DNSInfo dns;
+    dns.domainString = domain;
+    dns.question.qtype = DNS_TYPE_A;
+    dns.question.qclass = 1;
+    dns.isValid = dns.isResponse = dns.hasIPs = true;
+    dns.ipaddresses.push_back(0x7f000001);
+    dns.ttl = 300;
+    dns.expiry = QDateTime::currentDateTime().addSecs(3600);
+    return dns;
+}
+
+//Keys are made ahead of time so only the lookups themselves get timed
+static double timeLookups(DNSCache &cache, const std::vector<QByteArray> &keys, quint64 &found)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for(const QByteArray &key : keys)
+    {
+        if(cache.lookup(key) != INVALID_CACHE_HANDLE)
+            found++;
+    }
+    return (double)timer.nsecsElapsed() / keys.size();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    out << "entries\thit ns/lookup\tmiss ns/lookup\n";
+    for(quint32 entries = 1000; entries <= 1000000; entries *= 10)
+    {
+        DNSCache cache;
+        for(quint32 i = 0; i < entries; i++)
+        {
+            QString name = benchName(i);
+            cache.insert(DNSCache::makeKey(name, DNS_TYPE_A), benchEntry(name));
+        }
+
+        //A fixed LCG picks which names are asked for, so every run (and every size) does the same kind of work
+        std::vector<QByteArray> hitKeys, missKeys;
+        hitKeys.reserve(BENCH_LOOKUPS);
+        missKeys.reserve(BENCH_LOOKUPS);
+        quint32 seed = 12345;
+        for(quint32 i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            hitKeys.push_back(DNSCache::makeKey(benchName(seed % entries), DNS_TYPE_A));
+            missKeys.push_back(DNSCache::makeKey(QString("miss%1.example.com").arg(i), DNS_TYPE_A));
+        }
+
+        quint64 found = 0;
+        timeLookups(cache, hitKeys, found); //Warm up
+        found = 0;
+        double hitNs = timeLookups(cache, hitKeys, found);
+        double missNs = timeLookups(cache, missKeys, found);
+        if(found != BENCH_LOOKUPS)
+            out << "(only " << found << " of " << BENCH_LOOKUPS << " hit lookups found their entry!)\n";
+        out << entries << "\t" << QString::number(hitNs, 'f', 1) << "\t" << QString::number(missNs, 'f', 1) << "\n";
+        out.flush();
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QThread>
+#include <QUdpSocket>
+#include <QVector>
+#include "dnscache.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+//Throughput of a running YourFriendlyDNS: a few client threads, each keeping a window of queries outstanding on its own socket,
+//for a fixed time, then the answered queries per second.
+//  querybench [server] [port] [client threads] [seconds] [window]    (127.0.0.1 53 4 10 32 if left out)
+//The names asked for are under .invalid, so with the server in whitelist mode (the default) they're all answered locally
+//with the blocked response: it's the server's own receive/parse/list/respond path being measured, not upstream (or the cache).
+//For scaling from 1 to N cores, run it once for each dnsWorkerThreads setting (1, 2, 4... up to the core count, restarting
+//YourFriendlyDNS each time) with at least as many client threads as server threads, ideally from another machine so the clients
+//don't take cores from the server. Worker threads are Linux/Android only, elsewhere there's the one DNS thread whatever the setting.
+
+#define BENCH_NAMES 1000
+#define BENCH_REPLY_WAIT_MS 100
+
+class QueryThread : public QThread
+{
+public:
+    QueryThread(const QHostAddress &server, quint16 port, qint64 durationMs, int window, quint16 firstID)
+    {
+        this->server = server;
+        this->port = port;
+        this->durationMs = durationMs;
+        this->window = window;
+        nextID = firstID;
+        sent = answered = lost = 0;
+    }
+
+    void run()
+    {
+        //Queries made ahead of time, only the ID is changed for each one sent
+        QVector<QByteArray> queries;
+        for(int i = 0; i < BENCH_NAMES; i++)
+        {
+            quint16 header[6] = { 0, qToBigEndian((quint16)0x0100), qToBigEndian((quint16)1), 0, 0, 0 }; //RD set, one question
+            QByteArray query((const char*)header, sizeof header);
+            query.append(DNSCache::makeKey(QString("bench%1.yfd.invalid").arg(i), DNS_TYPE_A));
+            queries.append(query);
+        }
+
+        QUdpSocket sock;
+        QByteArray reply;
+        QElapsedTimer timer;
+        int outstanding = 0;
+        timer.start();
+        while(timer.elapsed() < durationMs)
+        {
+            while(outstanding < window)
+            {
+                QByteArray &query = queries[nextID % BENCH_NAMES];
+                *(quint16*)query.data() = qToBigEndian(nextID++);
+                sock.writeDatagram(query, server, port);
+                outstanding++;
+                sent++;
+            }
+
+            if(!sock.waitForReadyRead(BENCH_REPLY_WAIT_MS))
+            {
+                //Whatever's still out by now counts as timed out (a late reply still counts as answered), so the window doesn't shrink away to nothing
+                lost += outstanding;
+                outstanding = 0;
+                continue;
+            }
+            while(sock.hasPendingDatagrams())
+            {
+                reply.resize(sock.pendingDatagramSize());
+                sock.readDatagram(reply.data(), reply.size());
+                answered++;
+                if(outstanding > 0)
+                    outstanding--;
+            }
+        }
+    }
+
+    quint64 sent, answered, lost;
+
+private:
+    QHostAddress server;
+    quint16 port, nextID;
+    qint64 durationMs;
+    int window;
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QStringList args = QCoreApplication::arguments();
+
+    QHostAddress server(args.size() > 1 ? args[1] : QString("127.0.0.1"));
+    quint16 port = args.size() > 2 ? args[2].toUShort() : 53;
+    int threads = args.size() > 3 ? qBound(1, args[3].toInt(), 256) : 4;
+    int seconds = args.size() > 4 ? qBound(1, args[4].toInt(), 3600) : 10;
+    int window = args.size() > 5 ? qBound(1, args[5].toInt(), 4096) : 32;
+
+    QVector<QueryThread*> clients;
+    for(int i = 0; i < threads; i++)
+        clients.append(new QueryThread(server, port, seconds * 1000, window, (quint16)(i * (65536 / threads))));
+
+    QElapsedTimer timer;
+    timer.start();
+    for(QueryThread *client : clients)
+        client->start();
+    quint64 sent = 0, answered = 0, lost = 0;
+    for(QueryThread *client : clients)
+    {
+        client->wait();
+        sent += client->sent;
+        answered += client->answered;
+        lost += client->lost;
+        delete client;
+    }
+    double secs = timer.elapsed() / 1000.0;
+
+    out << "client threads\tsent\tanswered\ttimed out\tanswered/s\n";
+    out << threads << "\t" << sent << "\t" << answered << "\t" << lost << "\t" << QString::number(answered / secs, 'f', 0) << "\n";
+    return 0;
+}
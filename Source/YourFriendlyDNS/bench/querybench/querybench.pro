@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# DNS query throughput benchmark, not part of the app's build:
+# qmake && make in this directory, then run ./querybench against a running YourFriendlyDNS
+#
+#-------------------------------------------------
+
+QT       += core network
+QT       -= gui
+
+CONFIG += c++14 console
+CONFIG -= app_bundle
+
+TARGET = querybench
+TEMPLATE = app
+
+DEFINES += QT_NO_DEBUG_OUTPUT
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+        main.cpp \
+    ../../dnscache.cpp
+
+HEADERS += \
+    ../../dnscache.h \
+    ../../dnsinfo.h
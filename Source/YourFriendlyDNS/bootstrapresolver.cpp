@@ -0,0 +1,145 @@
+#include "bootstrapresolver.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+BootstrapResolver::BootstrapResolver()
+{
+    stopping = false;
+}
+
+BootstrapResolver::~BootstrapResolver()
+{
+    lock.lock();
+    stopping = true;
+    wanted.wakeAll();
+    lock.unlock();
+    wait();
+}
+
+BootstrapResolver *BootstrapResolver::instance()
+{
+    static BootstrapResolver resolver;
+    return &resolver;
+}
+
+void BootstrapResolver::setHostnames(const QVector<QString> &hostnames)
+{
+    QMutexLocker locker(&lock);
+    for(auto i = entries.begin(); i != entries.end();)
+    {
+        if(hostnames.contains(i.key()))
+            ++i;
+        else
+            i = entries.erase(i);
+    }
+    for(const QString &hostname : hostnames)
+    {
+        if(entries.contains(hostname))
+            continue;
+        Entry entry;
+        entry.refreshAt = 0;
+        entries.insert(hostname, entry);
+    }
+
+    wanted.wakeAll();
+    if(!isRunning() && !entries.isEmpty())
+        start(QThread::LowPriority);
+}
+
+QHostAddress BootstrapResolver::addressFor(const QString &hostname)
+{
+    QMutexLocker locker(&lock);
+    auto i = entries.find(hostname);
+    if(i == entries.end())
+    {
+        //Not one it was told about, it's looked up from now on anyway
+        Entry entry;
+        entry.refreshAt = 0;
+        entries.insert(hostname, entry);
+        wanted.wakeAll();
+        if(!isRunning())
+            start(QThread::LowPriority);
+        return QHostAddress();
+    }
+    return i->addresses.value(0);
+}
+
+void BootstrapResolver::run()
+{
+    lock.lock();
+    while(!stopping)
+    {
+        qint64 now = QDateTime::currentMSecsSinceEpoch(), nextRefresh = now + BOOTSTRAP_REFRESH_SECS * 1000;
+        QString due;
+        for(auto i = entries.begin(); i != entries.end(); ++i)
+        {
+            if(i->refreshAt <= now)
+            {
+                due = i.key();
+                break;
+            }
+            nextRefresh = qMin(nextRefresh, i->refreshAt);
+        }
+        if(due.isEmpty())
+        {
+            wanted.wait(&lock, (unsigned long)qMax((qint64)1, nextRefresh - now));
+            continue;
+        }
+
+        //The lookup blocks, connections can still read what's already here meanwhile
+        lock.unlock();
+        QHostInfo info = QHostInfo::fromName(due);
+        lock.lock();
+
+        auto i = entries.find(due);
+        if(i == entries.end())
+            continue; //Not a provider anymore
+        now = QDateTime::currentMSecsSinceEpoch();
+        if(info.error() != QHostInfo::NoError || info.addresses().isEmpty())
+        {
+            qDebug() << "Bootstrap lookup for provider:" << due << "failed:" << info.errorString();
+            i->refreshAt = now + BOOTSTRAP_RETRY_SECS * 1000;
+            continue;
+        }
+
+        //IPv4 first, there's a better chance of actually having a route to it
+        QList<QHostAddress> ipv6;
+        i->addresses.clear();
+        for(const QHostAddress &address : info.addresses())
+        {
+            if(address.protocol() == QAbstractSocket::IPv4Protocol)
+                i->addresses.append(address);
+            else
+                ipv6.append(address);
+        }
+        i->addresses.append(ipv6);
+        i->refreshAt = now + BOOTSTRAP_REFRESH_SECS * 1000;
+        qDebug() << "Bootstrapped provider:" << due << "to:" << i->addresses;
+    }
+    lock.unlock();
+}
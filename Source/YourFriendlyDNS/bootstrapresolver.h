@@ -0,0 +1,73 @@
+#ifndef BOOTSTRAPRESOLVER_H
+#define BOOTSTRAPRESOLVER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHostInfo>
+#include <QHostAddress>
+#include <QDateTime>
+#include <QHash>
+#include <QVector>
+#include <QDebug>
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define BOOTSTRAP_REFRESH_SECS 1800
+#define BOOTSTRAP_RETRY_SECS 60 //After a failed lookup, the addresses from before are still used meanwhile
+
+//Addresses for the DoH/DoT provider hostnames whose stamps don't have one. They're looked up ahead of time on a thread of their own
+//and kept fresh, so an upstream connection goes straight to an address and never waits on a name lookup
+//(which, with this server set as system dns, would otherwise loop back through it and the dedicated DNSCrypt provider first).
+class BootstrapResolver : public QThread
+{
+public:
+    static BootstrapResolver* instance();
+    ~BootstrapResolver();
+    void setHostnames(const QVector<QString> &hostnames);
+    //Null until the first lookup's done, the caller connects by hostname then
+    QHostAddress addressFor(const QString &hostname);
+
+protected:
+    void run();
+
+private:
+    BootstrapResolver();
+    struct Entry
+    {
+        QList<QHostAddress> addresses;
+        qint64 refreshAt;
+    };
+
+    QMutex lock;
+    QWaitCondition wanted;
+    QHash<QString, Entry> entries;
+    bool stopping;
+};
+
+#endif // BOOTSTRAPRESOLVER_H
@@ -80,6 +80,33 @@ void CacheViewer::displayCache(const std::vector<DNSInfo> &cache)
     }
 }
 
+void CacheViewer::displayCacheStats(const DNSCacheStats &stats)
+{
+    ui->cacheStats->setText(QString("Hit ratio: %1% (%2 hits, %3 misses)   Evicted: %4   Not admitted: %5   Memory: %6 of %7 MB in %8 entries")
+                            .arg(stats.hitRatio() * 100.0, 0, 'f', 1).arg(stats.hits).arg(stats.misses).arg(stats.evictions).arg(stats.rejections)
+                            .arg((double)stats.bytes / 1048576.0, 0, 'f', 2).arg(stats.budget / 1048576).arg(stats.entries)
+                            + QString("\nPrefetched: %1 (%2 answers served from them, %3% of hits)   Stale answers served: %4   Negative hits: %5")
+                            .arg(stats.prefetches).arg(stats.prefetchHits).arg(stats.hits ? (double)stats.prefetchHits * 100.0 / (double)stats.hits : 0.0, 0, 'f', 1)
+                            .arg(stats.staleAnswers).arg(stats.negativeHits));
+}
+
+void CacheViewer::displayKeypairPoolStats(const KeypairPoolStats &stats)
+{
+    //Only used with a new key per request
+    ui->keypairPoolStats->setVisible(stats.pools > 0);
+    ui->keypairPoolStats->setText(QString("Keypair pool: %1 of %2 ready   Generated: %3 (%4/s, %5 with shared key)   Used: %6   Made on the spot (pool empty): %7")
+                                  .arg(stats.depth).arg(stats.capacity).arg(stats.generated).arg(stats.keygenRate(), 0, 'f', 0)
+                                  .arg(stats.precomputed).arg(stats.taken).arg(stats.emptyFallbacks));
+}
+
+void CacheViewer::displayUpstreamStats(const UpstreamStats &stats)
+{
+    ui->upstreamStats->setVisible(stats.dohQueries > 0 || stats.dotQueries > 0);
+    ui->upstreamStats->setText(QString("DoH: %1 queries over %2 TLS handshakes (%3 per query), %4 connections on HTTP/2\nDoT: %5 queries over %6 TLS handshakes\nTLS: %7 full handshakes, %8 offering a session ticket to resume")
+                               .arg(stats.dohQueries).arg(stats.dohHandshakes).arg(stats.dohHandshakesPerQuery(), 0, 'f', 3).arg(stats.dohHttp2Connections)
+                               .arg(stats.dotQueries).arg(stats.dotHandshakes).arg(stats.tlsFullHandshakes).arg(stats.tlsTicketHandshakes));
+}
+
 void CacheViewer::on_okButton_clicked()
 {
     this->hide();
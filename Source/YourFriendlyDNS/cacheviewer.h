@@ -3,6 +3,9 @@
 
 #include <QMainWindow>
 #include "dnsinfo.h"
+#include "dnscache.h"
+#include "keypairpool.h"
+#include "upstreamconnections.h"
 
 /* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
 Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
@@ -48,6 +51,9 @@ signals:
 
 public slots:
     void displayCache(const std::vector<DNSInfo> &cache);
+    void displayCacheStats(const DNSCacheStats &stats);
+    void displayKeypairPoolStats(const KeypairPoolStats &stats);
+    void displayUpstreamStats(const UpstreamStats &stats);
 
 private slots:
     void on_okButton_clicked();
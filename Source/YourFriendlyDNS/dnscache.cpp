@@ -0,0 +1,760 @@
+#include "dnscache.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define CACHE_BUCKET_EMPTY 0U
+#define CACHE_BUCKET_TOMBSTONE 0xffffffffU
+#define CACHE_INITIAL_BUCKETS 64
+#define CACHE_AVERAGE_ENTRY_BYTES 512 //Only used to size the frequency sketch for a given budget
+
+FrequencySketch::FrequencySketch()
+{
+    resize(64);
+}
+
+void FrequencySketch::resize(size_t expectedEntries)
+{
+    width = 64;
+    while(width < expectedEntries)
+        width <<= 1;
+    counters.assign(width * 4, 0);
+    additions = 0;
+    sampleSize = width * 10;
+}
+
+size_t FrequencySketch::index(quint32 hash, int row) const
+{
+    static const quint32 seeds[4] = { 0x97cb3127U, 0xab7b2d81U, 0x6e5a8b3dU, 0x85ebca6bU };
+    quint32 h = hash * seeds[row];
+    h ^= h >> 15;
+    return (row * width) + (h & (width - 1));
+}
+
+void FrequencySketch::increment(quint32 hash)
+{
+    bool added = false;
+    for(int row = 0; row < 4; row++)
+    {
+        quint8 &c = counters[index(hash, row)];
+        if(c < 15)
+        {
+            c++;
+            added = true;
+        }
+    }
+
+    //Aging, every so often everything's halved so the counts follow what's popular now
+    if(added && ++additions >= sampleSize)
+    {
+        for(quint8 &c : counters)
+            c >>= 1;
+        additions /= 2;
+    }
+}
+
+int FrequencySketch::frequency(quint32 hash) const
+{
+    int f = 15;
+    for(int row = 0; row < 4; row++)
+        f = qMin(f, (int)counters[index(hash, row)]);
+    return f;
+}
+
+void FrequencySketch::clear()
+{
+    std::fill(counters.begin(), counters.end(), 0);
+    additions = 0;
+}
+
+DNSCache::DNSCache()
+{
+    numEntries = numTombstones = 0;
+    buckets.assign(CACHE_INITIAL_BUCKETS, CACHE_BUCKET_EMPTY);
+    maxBytes = maxWindowBytes = maxProtectedBytes = 0;
+    hits = misses = evictions = rejections = 0;
+}
+
+QByteArray DNSCache::makeKey(const QByteArray &dnsmessage, quint32 answeroffset)
+{
+    //The question section sits between the header and the answer offset: qname + qtype(2) + qclass(2)
+    if(answeroffset < DNS_HEADER_SIZE + 5 || answeroffset > (quint32)dnsmessage.size())
+        return QByteArray();
+
+    QByteArray key = dnsmessage.mid(DNS_HEADER_SIZE, answeroffset - DNS_HEADER_SIZE);
+    char *p = key.data();
+    int nameLen = key.size() - 4;
+    //Label length bytes are never above 63 so they can't be mistaken for 'A'-'Z', only qtype/qclass must be left alone
+    for(int i = 0; i < nameLen; i++)
+    {
+        if(p[i] >= 'A' && p[i] <= 'Z')
+            p[i] += ('a' - 'A');
+    }
+    return key;
+}
+
+QByteArray DNSCache::makeKey(const QString &domain, quint16 qtype, quint16 qclass)
+{
+    QByteArray key, name = domain.toLower().toUtf8();
+    key.reserve(name.size() + 6);
+
+    int labelStart = 0;
+    while(labelStart < name.size())
+    {
+        int labelEnd = name.indexOf('.', labelStart);
+        if(labelEnd == -1) labelEnd = name.size();
+        int labelLen = labelEnd - labelStart;
+        if(labelLen > 0 && labelLen <= 63)
+        {
+            key.append((char)labelLen);
+            key.append(name.constData() + labelStart, labelLen);
+        }
+        labelStart = labelEnd + 1;
+    }
+    key.append((char)0);
+
+    quint16 type = qToBigEndian(qtype), rclass = qToBigEndian(qclass);
+    key.append((const char*)&type, 2);
+    key.append((const char*)&rclass, 2);
+    return key;
+}
+
+quint32 DNSCache::hashKey(const QByteArray &key)
+{
+    //FNV-1a, keys are short (a single question) so this is cheap and spreads well enough for linear probing
+    quint32 hash = 2166136261U;
+    const quint8 *p = (const quint8*)key.constData();
+    for(int i = 0; i < key.size(); i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+size_t DNSCache::entryBytes(const QByteArray &key, const DNSInfo &dns)
+{
+    //An estimate, what the entry's own data takes plus a bit for the containers' bookkeeping
+    return sizeof(Slot) + sizeof(quint32) * 2 + key.size() + dns.req.size() + dns.res.size()
+            + dns.domainString.size() * sizeof(QChar) + dns.ipaddresses.size() * sizeof(quint32) + 96;
+}
+
+size_t DNSCache::findBucket(const QByteArray &key, quint32 hash) const
+{
+    size_t mask = buckets.size() - 1;
+    for(size_t i = hash & mask, probes = 0; probes < buckets.size(); i = (i + 1) & mask, probes++)
+    {
+        quint32 b = buckets[i];
+        if(b == CACHE_BUCKET_EMPTY)
+            break;
+        if(b == CACHE_BUCKET_TOMBSTONE)
+            continue;
+
+        const Slot &s = entrySlots[b - 1];
+        if(s.hash == hash && s.key == key)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+void DNSCache::rehash(size_t newBucketCount)
+{
+    buckets.assign(newBucketCount, CACHE_BUCKET_EMPTY);
+    numTombstones = 0;
+
+    size_t mask = newBucketCount - 1;
+    for(size_t s = 0; s < entrySlots.size(); s++)
+    {
+        if(!entrySlots[s].used) continue;
+
+        size_t i = entrySlots[s].hash & mask;
+        while(buckets[i] != CACHE_BUCKET_EMPTY)
+            i = (i + 1) & mask;
+        buckets[i] = (quint32)(s + 1);
+    }
+}
+
+DNSCache::LRUList &DNSCache::listFor(quint8 region)
+{
+    if(region == REGION_PROBATION) return probationLRU;
+    if(region == REGION_PROTECTED) return protectedLRU;
+    return windowLRU;
+}
+
+void DNSCache::link(CacheHandle handle, quint8 region)
+{
+    Slot &s = entrySlots[handle];
+    LRUList &list = listFor(region);
+    s.region = region;
+    s.prev = INVALID_CACHE_HANDLE;
+    s.next = list.head;
+    if(list.head != INVALID_CACHE_HANDLE)
+        entrySlots[list.head].prev = handle;
+    list.head = handle;
+    if(list.tail == INVALID_CACHE_HANDLE)
+        list.tail = handle;
+    list.bytes += s.bytes;
+}
+
+void DNSCache::unlink(CacheHandle handle)
+{
+    Slot &s = entrySlots[handle];
+    LRUList &list = listFor(s.region);
+    if(s.prev != INVALID_CACHE_HANDLE) entrySlots[s.prev].next = s.next;
+    else list.head = s.next;
+    if(s.next != INVALID_CACHE_HANDLE) entrySlots[s.next].prev = s.prev;
+    else list.tail = s.prev;
+    s.prev = s.next = INVALID_CACHE_HANDLE;
+    list.bytes -= s.bytes;
+}
+
+void DNSCache::touch(CacheHandle handle)
+{
+    Slot &s = entrySlots[handle];
+    sketch.increment(s.hash);
+
+    quint8 region = s.region;
+    unlink(handle);
+    if(region == REGION_PROBATION && maxBytes != 0)
+    {
+        //Used again while on probation, so it's earned a place in the protected segment,
+        //which pushes that segment's least recently used entries back onto probation when it's full
+        link(handle, REGION_PROTECTED);
+        while(protectedLRU.bytes > maxProtectedBytes && protectedLRU.tail != handle)
+        {
+            CacheHandle demoted = protectedLRU.tail;
+            unlink(demoted);
+            link(demoted, REGION_PROBATION);
+        }
+    }
+    else
+        link(handle, region);
+}
+
+void DNSCache::evict(CacheHandle handle)
+{
+    evictions++;
+    remove(handle);
+}
+
+void DNSCache::enforceBudget()
+{
+    if(maxBytes == 0) return;
+
+    //Whatever doesn't fit in the window anymore becomes a candidate for the main region
+    size_t maxMainBytes = maxBytes - maxWindowBytes;
+    while(windowLRU.bytes > maxWindowBytes && windowLRU.tail != INVALID_CACHE_HANDLE)
+    {
+        CacheHandle candidate = windowLRU.tail;
+        unlink(candidate);
+        link(candidate, REGION_PROBATION);
+
+        while(probationLRU.bytes + protectedLRU.bytes > maxMainBytes)
+        {
+            //Probation's least recently used entry is the one that'd make room, unless the candidate's all there is on probation
+            CacheHandle victim = probationLRU.tail;
+            if(victim == candidate || victim == INVALID_CACHE_HANDLE)
+                victim = protectedLRU.tail;
+            if(victim == INVALID_CACHE_HANDLE)
+            {
+                if(candidate != INVALID_CACHE_HANDLE)
+                {
+                    rejections++;
+                    evict(candidate);
+                }
+                break;
+            }
+
+            //TinyLFU admission, the newcomer only gets in if it's been asked for more often than what it would replace
+            if(candidate != INVALID_CACHE_HANDLE && sketch.frequency(entrySlots[candidate].hash) <= sketch.frequency(entrySlots[victim].hash))
+            {
+                rejections++;
+                evict(candidate);
+                candidate = INVALID_CACHE_HANDLE;
+            }
+            else
+                evict(victim);
+        }
+    }
+}
+
+CacheHandle DNSCache::find(const QByteArray &key) const
+{
+    if(key.isEmpty()) return INVALID_CACHE_HANDLE;
+
+    size_t bucket = findBucket(key, hashKey(key));
+    if(bucket == SIZE_MAX)
+        return INVALID_CACHE_HANDLE;
+    return buckets[bucket] - 1;
+}
+
+CacheHandle DNSCache::lookup(const QByteArray &key)
+{
+    CacheHandle handle = find(key);
+    if(handle == INVALID_CACHE_HANDLE)
+    {
+        //Misses count towards the sketch too, that's how a name proves it's worth keeping before it's ever been cached
+        if(!key.isEmpty()) sketch.increment(hashKey(key));
+        misses++;
+        return INVALID_CACHE_HANDLE;
+    }
+
+    hits++;
+    touch(handle);
+    return handle;
+}
+
+CacheHandle DNSCache::insert(const QByteArray &key, const DNSInfo &dns)
+{
+    if(key.isEmpty()) return INVALID_CACHE_HANDLE;
+
+    quint32 hash = hashKey(key);
+    size_t bucket = findBucket(key, hash);
+    if(bucket != SIZE_MAX)
+    {
+        CacheHandle existing = buckets[bucket] - 1;
+        Slot &s = entrySlots[existing];
+        quint8 region = s.region;
+        unlink(existing);
+        s.dns = dns;
+        s.bytes = entryBytes(key, dns);
+        link(existing, region);
+        enforceBudget();
+        return find(key);
+    }
+
+    //Keep the load (live + deleted buckets) under 75%, doubling only when the live entries need it
+    if((numEntries + numTombstones + 1) * 4 >= buckets.size() * 3)
+        rehash((numEntries + 1) * 2 >= buckets.size() ? buckets.size() * 2 : buckets.size());
+
+    CacheHandle handle;
+    if(freeSlots.size() > 0)
+    {
+        handle = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else
+    {
+        handle = (CacheHandle)entrySlots.size();
+        entrySlots.push_back(Slot());
+    }
+
+    Slot &s = entrySlots[handle];
+    s.key = key;
+    s.hash = hash;
+    s.used = true;
+    s.dns = dns;
+    s.bytes = entryBytes(key, dns);
+
+    size_t mask = buckets.size() - 1;
+    size_t i = hash & mask;
+    while(buckets[i] != CACHE_BUCKET_EMPTY && buckets[i] != CACHE_BUCKET_TOMBSTONE)
+        i = (i + 1) & mask;
+    if(buckets[i] == CACHE_BUCKET_TOMBSTONE)
+        numTombstones--;
+    buckets[i] = handle + 1;
+    numEntries++;
+
+    link(handle, REGION_WINDOW);
+    enforceBudget();
+    return entrySlots[handle].used ? handle : INVALID_CACHE_HANDLE;
+}
+
+DNSInfo &DNSCache::at(CacheHandle handle)
+{
+    return entrySlots[handle].dns;
+}
+
+const DNSInfo &DNSCache::at(CacheHandle handle) const
+{
+    return entrySlots[handle].dns;
+}
+
+void DNSCache::remove(CacheHandle handle)
+{
+    if(handle >= entrySlots.size() || !entrySlots[handle].used)
+        return;
+
+    unlink(handle);
+    Slot &s = entrySlots[handle];
+    size_t bucket = findBucket(s.key, s.hash);
+    if(bucket != SIZE_MAX)
+    {
+        buckets[bucket] = CACHE_BUCKET_TOMBSTONE;
+        numTombstones++;
+    }
+
+    s.used = false;
+    s.key.clear();
+    s.dns = DNSInfo();
+    s.bytes = 0;
+    freeSlots.push_back(handle);
+    numEntries--;
+}
+
+bool DNSCache::remove(const QByteArray &key)
+{
+    CacheHandle handle = find(key);
+    if(handle == INVALID_CACHE_HANDLE)
+        return false;
+
+    remove(handle);
+    return true;
+}
+
+void DNSCache::clear()
+{
+    entrySlots.clear();
+    freeSlots.clear();
+    numEntries = numTombstones = 0;
+    buckets.assign(CACHE_INITIAL_BUCKETS, CACHE_BUCKET_EMPTY);
+    windowLRU = probationLRU = protectedLRU = LRUList();
+    sketch.clear();
+}
+
+std::vector<DNSInfo> DNSCache::entries(std::vector<QByteArray> *keys) const
+{
+    std::vector<DNSInfo> all;
+    all.reserve(numEntries);
+    for(const Slot &s : entrySlots)
+    {
+        if(s.used)
+        {
+            all.push_back(s.dns);
+            if(keys) keys->push_back(s.key);
+        }
+    }
+    return all;
+}
+
+void DNSCache::setMemoryBudget(size_t bytes)
+{
+    if(bytes == maxBytes) return;
+
+    maxBytes = bytes;
+    maxWindowBytes = bytes / 100;
+    maxProtectedBytes = (bytes - maxWindowBytes) * 8 / 10;
+    sketch.resize(qMax(bytes / CACHE_AVERAGE_ENTRY_BYTES, (size_t)64));
+
+    if(maxBytes == 0)
+        return;
+
+    //Shrinking (or bounding for the first time), let everything in the main region that no longer fits go, least recently used first
+    while(protectedLRU.bytes > maxProtectedBytes)
+    {
+        CacheHandle demoted = protectedLRU.tail;
+        unlink(demoted);
+        link(demoted, REGION_PROBATION);
+    }
+    while(probationLRU.bytes + protectedLRU.bytes > maxBytes - maxWindowBytes && probationLRU.tail != INVALID_CACHE_HANDLE)
+        evict(probationLRU.tail);
+    enforceBudget();
+}
+
+DNSCacheStats DNSCache::stats() const
+{
+    DNSCacheStats st;
+    st.hits = hits;
+    st.misses = misses;
+    st.evictions = evictions;
+    st.rejections = rejections;
+    st.entries = numEntries;
+    st.bytes = windowLRU.bytes + probationLRU.bytes + protectedLRU.bytes;
+    st.budget = maxBytes;
+    return st;
+}
+
+SharedDNSCache::SharedDNSCache() : prefetches(0), prefetchHits(0), staleAnswers(0), negativeHits(0)
+{
+    setMemoryBudget((size_t)CACHE_DEFAULT_BUDGET_MB * 1024 * 1024);
+}
+
+bool SharedDNSCache::lookup(const QByteArray &key, DNSInfo &dns, int *frequency)
+{
+    Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.lock);
+    CacheHandle handle = shard.cache.lookup(key);
+    if(frequency)
+        *frequency = shard.cache.frequency(key);
+    if(handle == INVALID_CACHE_HANDLE)
+        return false;
+
+    dns = shard.cache.at(handle);
+    return true;
+}
+
+bool SharedDNSCache::peek(const QByteArray &key, DNSInfo &dns) const
+{
+    const Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.lock);
+    CacheHandle handle = shard.cache.find(key);
+    if(handle == INVALID_CACHE_HANDLE)
+        return false;
+
+    dns = shard.cache.at(handle);
+    return true;
+}
+
+void SharedDNSCache::store(const QByteArray &key, const DNSInfo &dns)
+{
+    Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.lock);
+    shard.cache.insert(key, dns);
+}
+
+bool SharedDNSCache::remove(const QByteArray &key)
+{
+    Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.lock);
+    return shard.cache.remove(key);
+}
+
+void SharedDNSCache::clear()
+{
+    for(Shard &shard : shards)
+    {
+        QMutexLocker locker(&shard.lock);
+        shard.cache.clear();
+    }
+}
+
+size_t SharedDNSCache::size() const
+{
+    size_t total = 0;
+    for(const Shard &shard : shards)
+    {
+        QMutexLocker locker(&shard.lock);
+        total += shard.cache.size();
+    }
+    return total;
+}
+
+std::vector<DNSInfo> SharedDNSCache::entries(std::vector<QByteArray> *keys) const
+{
+    std::vector<DNSInfo> all;
+    for(const Shard &shard : shards)
+    {
+        QMutexLocker locker(&shard.lock);
+        std::vector<DNSInfo> part = shard.cache.entries(keys);
+        all.insert(all.end(), part.begin(), part.end());
+    }
+    return all;
+}
+
+void SharedDNSCache::setMemoryBudget(size_t bytes)
+{
+    for(Shard &shard : shards)
+    {
+        QMutexLocker locker(&shard.lock);
+        shard.cache.setMemoryBudget(bytes / CACHE_SHARDS);
+    }
+}
+
+DNSCacheStats SharedDNSCache::stats() const
+{
+    DNSCacheStats total;
+    for(const Shard &shard : shards)
+    {
+        QMutexLocker locker(&shard.lock);
+        total += shard.cache.stats();
+    }
+    total.prefetches = prefetches.loadAcquire();
+    total.prefetchHits = prefetchHits.loadAcquire();
+    total.staleAnswers = staleAnswers.loadAcquire();
+    total.negativeHits = negativeHits.loadAcquire();
+    return total;
+}
+
+//Snapshot layout, all little endian:
+//header: magic[8] version:u32 count:u32 savedAt:i64 (ms since epoch) payloadSize:u32 checksum:u32 (FNV-1a of the payload)
+//then count records of: key, res, domain (u16 length + bytes each), qtype:u16 qclass:u16 answeroffset:u32 minTTL:i32
+//flags:u8 (1 hasIPs, 2 prefetched, 4 negative) ipCount:u16 ips:u32[ipCount] cachedAt:i64 expiry:i64
+//Times are absolute, so however long the process was down already counts against every entry's TTL.
+#define CACHE_SNAPSHOT_HEADER_SIZE 32
+
+namespace
+{
+    template<typename T> void put(QByteArray &out, T value)
+    {
+        char bytes[sizeof(T)];
+        qToLittleEndian(value, (uchar*)bytes);
+        out.append(bytes, sizeof(T));
+    }
+
+    void putBytes(QByteArray &out, const QByteArray &bytes)
+    {
+        put<quint16>(out, (quint16)bytes.size());
+        out.append(bytes);
+    }
+
+    //Reads a mapped snapshot, every read is bounds checked so a truncated or mangled file just stops the load
+    class SnapshotReader
+    {
+    public:
+        SnapshotReader(const uchar *data, qint64 size) : p(data), end(data + size), ok(true) {}
+
+        template<typename T> T get()
+        {
+            if(end - p < (qint64)sizeof(T)) { ok = false; return T(0); }
+            T value = qFromLittleEndian<T>(p);
+            p += sizeof(T);
+            return value;
+        }
+
+        QByteArray getBytes()
+        {
+            quint16 len = get<quint16>();
+            if(!ok || end - p < len) { ok = false; return QByteArray(); }
+            QByteArray bytes((const char*)p, len);
+            p += len;
+            return bytes;
+        }
+
+        const uchar *p, *end;
+        bool ok;
+    };
+}
+
+bool SharedDNSCache::saveSnapshot(const QString &path) const
+{
+    std::vector<QByteArray> keys;
+    std::vector<DNSInfo> all = entries(&keys);
+
+    QByteArray payload;
+    quint32 count = 0;
+    for(size_t i = 0; i < all.size(); i++)
+    {
+        const DNSInfo &dns = all[i];
+        QByteArray domain = dns.domainString.toUtf8();
+        if(keys[i].size() > 0xffff || dns.res.size() > 0xffff || domain.size() > 0xffff || dns.ipaddresses.size() > 0xffff)
+            continue;
+
+        putBytes(payload, keys[i]);
+        putBytes(payload, dns.res);
+        putBytes(payload, domain);
+        put<quint16>(payload, dns.question.qtype);
+        put<quint16>(payload, dns.question.qclass);
+        put<quint32>(payload, dns.answeroffset);
+        put<qint32>(payload, dns.minTTL);
+        put<quint8>(payload, (dns.hasIPs ? 1 : 0) | (dns.prefetched ? 2 : 0) | (dns.negative ? 4 : 0));
+        put<quint16>(payload, (quint16)dns.ipaddresses.size());
+        for(quint32 ip : dns.ipaddresses)
+            put<quint32>(payload, ip);
+        put<qint64>(payload, dns.cachedAt.toMSecsSinceEpoch());
+        put<qint64>(payload, dns.expiry.toMSecsSinceEpoch());
+        count++;
+    }
+
+    QByteArray header(CACHE_SNAPSHOT_MAGIC, 8);
+    put<quint32>(header, CACHE_SNAPSHOT_VERSION);
+    put<quint32>(header, count);
+    put<qint64>(header, QDateTime::currentMSecsSinceEpoch());
+    put<quint32>(header, (quint32)payload.size());
+    put<quint32>(header, DNSCache::hashKey(payload));
+
+    //QSaveFile only replaces the old snapshot once the new one's completely written
+    QSaveFile file(path);
+    if(!file.open(QFile::WriteOnly))
+    {
+        qDebug() << "Couldn't write the cache snapshot to:" << path;
+        return false;
+    }
+    file.write(header);
+    file.write(payload);
+    if(!file.commit())
+    {
+        qDebug() << "Couldn't write the cache snapshot to:" << path;
+        return false;
+    }
+    qDebug() << "Saved" << count << "cache entries to:" << path << "(" << (header.size() + payload.size()) << "bytes)";
+    return true;
+}
+
+int SharedDNSCache::loadSnapshot(const QString &path, qint64 keepExpiredSecs)
+{
+    QFile file(path);
+    if(!file.open(QFile::ReadOnly) || file.size() < CACHE_SNAPSHOT_HEADER_SIZE)
+        return 0;
+
+    const uchar *data = file.map(0, file.size());
+    if(!data)
+        return 0;
+
+    SnapshotReader in(data, file.size());
+    in.p += 8;
+    quint32 version = in.get<quint32>(), count = in.get<quint32>();
+    qint64 savedAt = in.get<qint64>();
+    quint32 payloadSize = in.get<quint32>(), checksum = in.get<quint32>();
+
+    if(memcmp(data, CACHE_SNAPSHOT_MAGIC, 8) != 0 || version != CACHE_SNAPSHOT_VERSION || (qint64)payloadSize != file.size() - CACHE_SNAPSHOT_HEADER_SIZE
+       || DNSCache::hashKey(QByteArray::fromRawData((const char*)in.p, payloadSize)) != checksum)
+    {
+        qDebug() << "Cache snapshot:" << path << "is from another version or damaged, starting with an empty cache";
+        file.unmap((uchar*)data);
+        return 0;
+    }
+
+    //If the clock went backwards since saving there's no telling how long we were down, so count it as no time at all
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 shift = qMin(now - savedAt, (qint64)0);
+    int loaded = 0;
+    for(quint32 i = 0; i < count && in.ok; i++)
+    {
+        DNSInfo dns;
+        QByteArray key = in.getBytes();
+        dns.res = in.getBytes();
+        dns.domainString = QString::fromUtf8(in.getBytes());
+        dns.question.qtype = in.get<quint16>();
+        dns.question.qclass = in.get<quint16>();
+        dns.answeroffset = in.get<quint32>();
+        dns.minTTL = in.get<qint32>();
+        quint8 flags = in.get<quint8>();
+        quint16 ipCount = in.get<quint16>();
+        for(quint16 ip = 0; ip < ipCount && in.ok; ip++)
+            dns.ipaddresses.push_back(in.get<quint32>());
+        qint64 cachedAt = in.get<qint64>() + shift, expiry = in.get<qint64>() + shift;
+
+        if(!in.ok || key.isEmpty() || dns.res.size() < DNS_HEADER_SIZE || dns.answeroffset > (quint32)dns.res.size())
+            break;
+        if(expiry + keepExpiredSecs * 1000 < now)
+            continue;
+
+        memcpy(&dns.header, dns.res.constData(), sizeof(dns.header));
+        dns.hasIPs = (flags & 1);
+        dns.prefetched = (flags & 2);
+        dns.negative = (flags & 4);
+        dns.isValid = dns.isResponse = true;
+        dns.cachedAt = QDateTime::fromMSecsSinceEpoch(cachedAt);
+        dns.expiry = QDateTime::fromMSecsSinceEpoch(expiry);
+        store(key, dns);
+        loaded++;
+    }
+
+    file.unmap((uchar*)data);
+    qDebug() << "Loaded" << loaded << "of" << count << "cache entries from snapshot:" << path << "saved" << (now - savedAt) / 1000 << "secs ago";
+    return loaded;
+}
@@ -0,0 +1,203 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QtEndian>
+#include <QMutex>
+#include <QFile>
+#include <QSaveFile>
+#include <vector>
+#include <cstdint>
+#include "dnsinfo.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+//A handle stays valid (and points at the same entry) until that entry is removed, evicted or the cache is cleared,
+//so callers can look an entry up once and then update it in place without searching again.
+typedef quint32 CacheHandle;
+#define INVALID_CACHE_HANDLE 0xffffffffU
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_BUDGET_MB 32
+#define CACHE_SNAPSHOT_MAGIC "YFDNSSNP"
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SNAPSHOT_INTERVAL_MS (5 * 60 * 1000)
+
+class DNSCacheStats
+{
+public:
+    DNSCacheStats() { hits = misses = evictions = rejections = entries = bytes = budget = prefetches = prefetchHits = staleAnswers = negativeHits = 0; }
+    double hitRatio() const { return (hits + misses) ? (double)hits / (double)(hits + misses) : 0.0; }
+    DNSCacheStats &operator+=(const DNSCacheStats &other)
+    {
+        hits += other.hits; misses += other.misses; evictions += other.evictions; rejections += other.rejections;
+        entries += other.entries; bytes += other.bytes; budget += other.budget;
+        prefetches += other.prefetches; prefetchHits += other.prefetchHits; staleAnswers += other.staleAnswers;
+        negativeHits += other.negativeHits;
+        return *this;
+    }
+
+    quint64 hits, misses, evictions, rejections, entries, bytes, budget;
+    quint64 prefetches, prefetchHits, staleAnswers; //Refreshes sent ahead of expiry, answers served from them, expired answers handed out
+    quint64 negativeHits; //Hits that were cached NXDOMAIN/NODATA answers (also counted in hits)
+};
+
+//Roughly how often each key's been asked for lately: a count-min sketch of 4 bit-ish counters (capped at 15)
+//that get halved every so often, so names that were popular an hour ago fade out.
+class FrequencySketch
+{
+public:
+    FrequencySketch();
+    void resize(size_t expectedEntries);
+    void increment(quint32 hash);
+    int frequency(quint32 hash) const;
+    void clear();
+
+private:
+    size_t index(quint32 hash, int row) const;
+
+    std::vector<quint8> counters; //4 rows of width counters each
+    size_t width, additions, sampleSize;
+};
+
+//With a memory budget set this is a W-TinyLFU cache: new entries go into a small LRU window (1% of the budget),
+//whatever falls out of the window has to be asked for more often (going by the sketch) than the entry the main region
+//would evict for it, or it's dropped instead. The main region is a segmented LRU, probation and protected (80%),
+//entries get promoted to protected when they're hit again. So a scan of one-off names can't push out the names we actually use.
+class DNSCache
+{
+public:
+    DNSCache();
+
+    //Keys are the question section exactly as it appears on the wire (qname labels + qtype + qclass),
+    //with the qname case-folded, so "GitHub.com" and "github.com" land in the same entry.
+    static QByteArray makeKey(const QByteArray &dnsmessage, quint32 answeroffset);
+    static QByteArray makeKey(const QString &domain, quint16 qtype, quint16 qclass = 1);
+    static quint32 hashKey(const QByteArray &key);
+
+    CacheHandle find(const QByteArray &key) const;
+    CacheHandle lookup(const QByteArray &key); //find() that also counts as a use of the entry, for answering queries
+    int frequency(const QByteArray &key) const { return sketch.frequency(hashKey(key)); }
+    CacheHandle insert(const QByteArray &key, const DNSInfo &dns);
+    DNSInfo &at(CacheHandle handle);
+    const DNSInfo &at(CacheHandle handle) const;
+    void remove(CacheHandle handle);
+    bool remove(const QByteArray &key);
+    void clear();
+    size_t size() const { return numEntries; }
+    std::vector<DNSInfo> entries(std::vector<QByteArray> *keys = nullptr) const;
+
+    void setMemoryBudget(size_t bytes); //0 means unbounded
+    DNSCacheStats stats() const;
+
+private:
+    enum Region { REGION_WINDOW, REGION_PROBATION, REGION_PROTECTED };
+
+    struct Slot
+    {
+        QByteArray key;
+        quint32 hash;
+        bool used;
+        DNSInfo dns;
+        CacheHandle prev, next;
+        quint8 region;
+        size_t bytes;
+    };
+
+    struct LRUList
+    {
+        LRUList() { head = tail = INVALID_CACHE_HANDLE; bytes = 0; }
+        CacheHandle head, tail; //head is the most recently used
+        size_t bytes;
+    };
+
+    static size_t entryBytes(const QByteArray &key, const DNSInfo &dns);
+    size_t findBucket(const QByteArray &key, quint32 hash) const;
+    void rehash(size_t newBucketCount);
+    LRUList &listFor(quint8 region);
+    void link(CacheHandle handle, quint8 region);
+    void unlink(CacheHandle handle);
+    void touch(CacheHandle handle);
+    void evict(CacheHandle handle);
+    void enforceBudget();
+
+    //Open addressing with linear probing, each bucket holds (slot index + 1), 0 is empty and TOMBSTONE is a deleted bucket
+    std::vector<quint32> buckets;
+    std::vector<Slot> entrySlots;
+    std::vector<CacheHandle> freeSlots;
+    size_t numEntries, numTombstones;
+
+    LRUList windowLRU, probationLRU, protectedLRU;
+    size_t maxBytes, maxWindowBytes, maxProtectedBytes;
+    FrequencySketch sketch;
+    quint64 hits, misses, evictions, rejections;
+};
+
+//The cache every DNS worker thread shares, split into shards that each have their own lock
+//so workers answering different names almost never wait on each other.
+//Entries are copied in and out (DNSInfo's byte arrays are implicitly shared so that's cheap), nothing points into a shard from outside.
+class SharedDNSCache
+{
+public:
+    SharedDNSCache();
+    bool lookup(const QByteArray &key, DNSInfo &dns, int *frequency = nullptr);
+    bool peek(const QByteArray &key, DNSInfo &dns) const; //Copies the entry out without counting it as a hit or a use
+    void store(const QByteArray &key, const DNSInfo &dns);
+    bool remove(const QByteArray &key);
+    void clear();
+    size_t size() const;
+    std::vector<DNSInfo> entries(std::vector<QByteArray> *keys = nullptr) const;
+    void setMemoryBudget(size_t bytes);
+    DNSCacheStats stats() const;
+
+    //Warm restarts: the whole cache written to one file, and read back (mapped, not copied) on startup.
+    //Entries that expired more than keepExpiredSecs before loading are left out.
+    bool saveSnapshot(const QString &path) const;
+    int loadSnapshot(const QString &path, qint64 keepExpiredSecs = 0);
+
+    void countPrefetch() { prefetches.fetchAndAddRelaxed(1); }
+    void countPrefetchHit() { prefetchHits.fetchAndAddRelaxed(1); }
+    void countStaleAnswer() { staleAnswers.fetchAndAddRelaxed(1); }
+    void countNegativeHit() { negativeHits.fetchAndAddRelaxed(1); }
+
+private:
+    struct Shard
+    {
+        mutable QMutex lock;
+        DNSCache cache;
+    };
+
+    //The top bits pick the shard, the low bits are left for the shard's own buckets
+    Shard &shardFor(const QByteArray &key) { return shards[DNSCache::hashKey(key) >> 28]; }
+    const Shard &shardFor(const QByteArray &key) const { return shards[DNSCache::hashKey(key) >> 28]; }
+
+    Shard shards[CACHE_SHARDS];
+    QAtomicInteger<quint64> prefetches, prefetchHits, staleAnswers, negativeHits;
+};
+
+#endif // DNSCACHE_H
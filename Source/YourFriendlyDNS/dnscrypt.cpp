@@ -31,19 +31,10 @@ DNSCrypt::DNSCrypt(QObject *parent)
 {
     Q_UNUSED(parent);
 
-    //Default is opendns dnscrypt
-    providerName = "2.dnscrypt-cert.opendns.com";
-    //opendns dnscrypt pub key: B735:1140:206F:225D:3E2B:D822:D7FD:691E:A1C3:3CC8:D666:8D0C:BE04:BFAB:CA43:FB79
-    quint8 defaultProviderPubKey[crypto_box_PUBLICKEYBYTES] = {0xB7, 0x35, 0x11, 0x40, 0x20, 0x6F, 0x22, 0x5D, 0x3E, 0x2B, 0xD8, 0x22, 0xD7, 0xFD, 0x69, 0x1E, 0xA1, 0xC3, 0x3C, 0xC8, 0xD6, 0x66, 0x8D, 0x0C, 0xBE, 0x04, 0xBF, 0xAB, 0xCA, 0x43, 0xFB, 0x79};
-    memcpy(&providerKey, &defaultProviderPubKey, sizeof defaultProviderPubKey);
-    quint8 serverMagic[DNSCRYPT_MAGIC_QUERY_LEN] = {0x72, 0x36, 0x66, 0x6e, 0x76, 0x57, 0x6a, 0x38};
-    memcpy(&resolverMagic, &serverMagic, sizeof serverMagic);
-    memset(&currentCert, 0, sizeof currentCert);
-    currentServer = QHostAddress("208.67.220.220");
-    currentPort = 443;
-    protocolVersion = 1;
     dnsCryptEnabled = true;
-    newKeyPerRequest = pendingValidation = false;
+    newKeyPerRequest = false;
+    connect(&certRefreshTimer, &QTimer::timeout, this, &DNSCrypt::refreshCertificates);
+    certRefreshTimer.start(60000);
     userAgent = "Mozilla/5.0 (Macintosh; Intel Mac OS X 10.12; rv:60.0) Gecko/20100101 Firefox/60.0";
 
     if(sodium_init() < 0)
@@ -55,243 +46,383 @@ DNSCrypt::DNSCrypt(QObject *parent)
     {
         qDebug() << "[libsodium initialized successfully] :) Yes! We can dnscrypt now!";
         dnsCryptAvailable = true;
-        connect(&udp, &QUdpSocket::readyRead, this, &DNSCrypt::validateCertificates);
     }
 }
 
-void DNSCrypt::buildTXTRecord(QByteArray &txt)
+DNSCrypt::~DNSCrypt()
 {
-    DNS_HEADER header;
-    QUESTION question;
-    memset(&header, 0, sizeof header);
-
-    header.id = randombytes_random();
-    header.rd = 1;
-    header.q_count = qToBigEndian((quint16)1);
-
-    question.qtype = qToBigEndian((quint16)DNS_TYPE_TXT);
-    question.qclass = qToBigEndian((quint16)1);
-
-    txt.append((char*)&header, sizeof header);
-
-    QStringList parts = providerName.split(".");
-    for(QString &p : parts)
+    //Aliases are skipped, their session goes through its own stamp
+    for(auto i = sessions.constBegin(); i != sessions.constEnd(); ++i)
     {
-        quint8 s = p.size();
-        txt.append(s);
-        txt.append(p);
+        if(i.key() == i.value()->stamp)
+            delete i.value();
     }
-    txt.append((char)0);
-
-    txt.append((char*)&question, sizeof question);
-    qDebug() << "Built TXT query (to get and validate server certificate):" << txt;
 }
 
-void DNSCrypt::getValidServerCertificate(DNSInfo &dns)
+void DNSCrypt::pruneSessions(const QSet<QString> &stamps)
 {
-    pendingValidation = true;
-
-    QByteArray txt;
-    buildTXTRecord(txt);
+    //Stamps no longer in use take their session with them (sockets, connections, certificates and all),
+    //the default provider's is always kept since invalid stamps are aliases of it
+    QSet<DNSCryptSession*> removed;
+    for(auto i = sessions.begin(); i != sessions.end();)
+    {
+        if(stamps.contains(i.key()) || i.key() == DNSCRYPT_DEFAULT_STAMP)
+        {
+            ++i;
+            continue;
+        }
+        if(i.key() == i.value()->stamp)
+            removed.insert(i.value());
+        i = sessions.erase(i);
+    }
+    if(removed.isEmpty())
+        return;
 
-    udp.writeDatagram(txt, currentServer, currentPort);
-    CertificateHolder *cr = new CertificateHolder(dns, providerName, currentServer, currentPort);
-    if(cr)
+    //No alias is left pointing at a session that's going
+    for(auto i = sessions.begin(); i != sessions.end();)
     {
-        certCache.append(cr);
-        connect(this, &DNSCrypt::certificateVerifiedDoEncryptedLookup, cr, &CertificateHolder::certificateVerifiedDoEncryptedLookup);
-        connect(cr, &CertificateHolder::decryptedLookupDoneSendResponseNow, this, &DNSCrypt::decryptedLookupDoneSendResponseNow);
+        if(removed.contains(i.value()))
+            i = sessions.erase(i);
+        else
+            ++i;
     }
+    if(!sessions.contains(lastUsedStamp))
+        lastUsedStamp.clear();
+    qDebug() << "Closed sessions for" << removed.size() << "providers no longer in use";
+    for(DNSCryptSession *s : removed)
+        s->deleteLater();
 }
 
-CertificateHolder *DNSCrypt::getCachedCert(QHostAddress server, QString provider)
+DNSCryptSession *DNSCrypt::session(const QString &dnscryptStamp)
 {
-    for(CertificateHolder *c : certCache)
+    //A stamp is decoded once, the first time it's used, and its session kept from then on.
+    //One that can't be used maps to the default provider's session instead
+    DNSCryptSession *s = sessions.value(dnscryptStamp);
+    if(s != nullptr)
+        return s;
+
+    s = new DNSCryptSession(dnscryptStamp, userAgent);
+    if(!s->isValid())
     {
-        if(c->certServer == server && c->providerName == provider)
-        {
-            return c;
-        }
+        delete s;
+        if(dnscryptStamp == DNSCRYPT_DEFAULT_STAMP)
+            return nullptr;
+        qDebug() << "Invalid or unsupported stamp, using the default provider instead:" << dnscryptStamp;
+        s = session(DNSCRYPT_DEFAULT_STAMP);
+        if(s != nullptr)
+            sessions.insert(dnscryptStamp, s);
+        return s;
     }
-    return nullptr;
+
+    connect(s, &DNSCryptSession::decryptedLookupDoneSendResponseNow, this, &DNSCrypt::decryptedLookupDoneSendResponseNow);
+    sessions.insert(dnscryptStamp, s);
+    return s;
 }
 
-DoHDoTLSResponse::DoHDoTLSResponse(DNSInfo &dns, const QByteArray &dohRequest, QObject *parent)
+void DNSCrypt::makeEncryptedRequest(DNSInfo &dns, const QString &dnscryptStamp)
 {
-    Q_UNUSED(parent);
-    respondTo = dns;
-
-    connect(&tls, SIGNAL(disconnected()), this, SLOT(deleteLater()));
-    connect(&tls, &QSslSocket::peerVerifyError, this, &DoHDoTLSResponse::verifyError);
+    DNSCryptSession *s = session(dnscryptStamp);
+    if(s == nullptr)
+    {
+        QByteArray servfail = servfailFor(dns);
+        emit decryptedLookupDoneSendResponseNow(servfail, dns);
+        return;
+    }
 
-    if(dohRequest.size() > 0)
+    if(s->stamp != lastUsedStamp)
     {
-        dohrequest = dohRequest;
-        connect(&tls, SIGNAL(encrypted()), this, SLOT(writeEncryptedDoH()));
-        connect(&tls, SIGNAL(readyRead()), this, SLOT(getAndDecryptResponseDoH()));
+        lastUsedStamp = s->stamp;
+        emit displayLastUsedProvider(s->props, (s->protocolVersion == 1) ? s->providerName : s->hostname, s->server, s->port);
     }
-    else
+    s->makeEncryptedRequest(dns, newKeyPerRequest);
+}
+
+void DNSCrypt::refreshCertificates()
+{
+    quint64 now = getTimeNow();
+    for(auto i = sessions.constBegin(); i != sessions.constEnd(); ++i)
     {
-        connect(&tls, SIGNAL(encrypted()), this, SLOT(writeEncryptedDoTLS()));
-        connect(&tls, SIGNAL(readyRead()), this, SLOT(getAndDecryptResponseDoTLS()));
+        if(i.key() == i.value()->stamp) //Skips the invalid stamps pointing at the default one
+            i.value()->refreshCertificateIfDue(now);
     }
 }
 
-void DoHDoTLSResponse::verifyError(const QSslError error)
+QByteArray DNSCrypt::servfailFor(const DNSInfo &dns)
 {
-    qDebug() << "TLS Error:" << error.errorString();
+    //Just the question sent back with SERVFAIL, so the client gives up (or tries elsewhere) now rather than after its own timeout
+    QByteArray response = dns.req.left(dns.answeroffset);
+    if(response.size() < DNS_HEADER_SIZE)
+        return response;
+
+    DNS_HEADER *header = (DNS_HEADER*)response.data();
+    header->QUERY_RESPONSE_FLAG = 1;
+    header->RECURSION_AVAILABLE_FLAG = 1;
+    header->rcode = RCODE_SERVFAIL;
+    header->ans_count = header->auth_count = header->add_count = 0;
+    return response;
 }
 
-void DoHDoTLSResponse::startEncryption()
+DNSCryptSession::DNSCryptSession(QString dnscryptStamp, QString useragent, QObject *parent)
 {
-    qDebug() << "Starting encryption! peerAddress:" << tls.peerAddress() << "port:" << tls.peerPort();
-    tls.startClientEncryption();
+    Q_UNUSED(parent);
+
+    DNSCryptProvider provider(dnscryptStamp.toUtf8());
+    stamp = dnscryptStamp;
+    userAgent = useragent;
+    protocolVersion = provider.protocolVersion;
+    props = provider.props;
+    hostname = provider.hostname;
+    path = provider.path;
+    port = provider.port;
+    memset(providerKey, 0, sizeof providerKey);
+    holder = nullptr;
+    dotConnection = nullptr;
+    newKeyPerRequest = pendingValidation = false;
+
+    //Because of stamp specification note, I resolve the ip to use from hostname if addr is empty or just a port (I take the port and set it empty in that case):
+    //"addr is the IP address of the server. It can be an empty string, or just a port number. In that case, the host name will be resolved to an IP address using another resolver."
+    //Note: connectToHostEncrypted with hostname is used instead of connectToHost with ip when server is null, which results in resolving it automatically,
+    //and using this server itself if system dns is set to use it.
+    if(provider.addr.size() != 0)
+        server = QHostAddress(provider.addr);
+
+    if(protocolVersion == 1)
+    {
+        providerName = provider.providerName;
+        if(provider.providerPubKey.size() != crypto_box_PUBLICKEYBYTES)
+        {
+            protocolVersion = 0;
+            return;
+        }
+        memcpy(providerKey, provider.providerPubKey.data(), crypto_box_PUBLICKEYBYTES);
+
+        holder = new CertificateHolder(stamp, providerName, server, port);
+        connect(holder, &CertificateHolder::decryptedLookupDoneSendResponseNow, this, &DNSCryptSession::decryptedLookupDoneSendResponseNow);
+        validationTimer.setSingleShot(true);
+        connect(&validationTimer, &QTimer::timeout, this, &DNSCryptSession::validationTimedOut);
+        connect(&udp, &QUdpSocket::readyRead, this, &DNSCryptSession::validateCertificates);
+    }
+    else if(protocolVersion != 2 && protocolVersion != 3)
+        protocolVersion = 0;
 }
 
-void DoHDoTLSResponse::writeEncryptedDoH()
+DNSCryptSession::~DNSCryptSession()
 {
-    tls.write(dohrequest);
-    qDebug() << "Sent DoH request:" << dohrequest;
+    delete holder;
+    qDeleteAll(dohConnections);
+    delete dotConnection;
 }
 
-void DoHDoTLSResponse::getAndDecryptResponseDoH()
+void DNSCryptSession::buildTXTRecord(QByteArray &txt)
 {
-    QByteArray decryptedResponse = tls.readAll(); //Well, TLS decrypts it for us...
-    qDebug() << "Received DoH response:" << decryptedResponse;
-    if(decryptedResponse.size() > 0 && decryptedResponse.contains("200 OK"))
+    DNS_HEADER header;
+    QUESTION question;
+    memset(&header, 0, sizeof header);
+
+    header.id = randombytes_random();
+    header.rd = 1;
+    header.q_count = qToBigEndian((quint16)1);
+
+    question.qtype = qToBigEndian((quint16)DNS_TYPE_TXT);
+    question.qclass = qToBigEndian((quint16)1);
+
+    txt.append((char*)&header, sizeof header);
+
+    QStringList parts = providerName.split(".");
+    for(QString &p : parts)
     {
-        int contentPos = decryptedResponse.lastIndexOf("\r\n\r\n");
-        if(contentPos != -1)
-        {
-            decryptedResponse.remove(0, contentPos + 4);
-            qDebug() << "Just the dns message:" << decryptedResponse;
-            emit decryptedLookupDoneSendResponseNow(decryptedResponse, respondTo);
-        }
+        quint8 s = p.size();
+        txt.append(s);
+        txt.append(p);
     }
+    txt.append((char)0);
+
+    txt.append((char*)&question, sizeof question);
+    qDebug() << "Built TXT query (to get and validate server certificate):" << txt;
 }
 
-void DoHDoTLSResponse::writeEncryptedDoTLS()
+void DNSCryptSession::getValidServerCertificate()
 {
-    quint16 prependedLen = respondTo.req.size();
-    prependedLen = qToBigEndian(prependedLen);
-    respondTo.req.prepend((const char*)&prependedLen, 2);
+    pendingValidation = true;
+
+    QByteArray txt;
+    buildTXTRecord(txt);
 
-    tls.write(respondTo.req);
-    qDebug() << "Sent DoTLS request:" << respondTo.req;
+    udp.writeDatagram(txt, server, port);
+    holder->usedSinceRefresh = false;
+    validationTimer.start(DNSCRYPT_VALIDATION_TIMEOUT_MS);
 }
 
-void DoHDoTLSResponse::getAndDecryptResponseDoTLS()
+void DNSCryptSession::refreshCertificateIfDue(quint64 now)
 {
-    QByteArray decryptedResponse = tls.readAll();
-    qDebug() << "Received DoTLS response:" << decryptedResponse;
-    if(decryptedResponse.size() > 2)
+    //Fetches certificates again well before they run out, so queries never end up waiting on one.
+    //Providers nobody's asked anything of since the last fetch are left alone
+    if(protocolVersion != 1 || pendingValidation)
+        return;
+
+    if(now >= holder->nextRefresh && holder->usedSinceRefresh)
     {
-        decryptedResponse.remove(0, 2);
-        emit decryptedLookupDoneSendResponseNow(decryptedResponse, respondTo);
+        qDebug() << "Refreshing the certificate ahead of time for provider:" << providerName << "server:" << server;
+        getValidServerCertificate();
     }
 }
 
-void DNSCrypt::sendDoHDoTLS(DNSInfo &dns, DNSCryptProtocol protocol)
+void DNSCryptSession::queueForValidation(DNSInfo &dns)
 {
-    QByteArray dohRequest;
-    if(protocol == DNSCryptProtocol::DNSoverHTTPS)
+    if(queuedForValidation.size() >= (int)DNSCRYPT_VALIDATION_QUEUE_LIMIT)
     {
-        QString post_request_header=R"(POST %1 HTTP/1.1
-Host: %2
-User-Agent: %3
-Accept: application/dns-udpwireformat
-Content-Type: application/dns-udpwireformat
-Content-Length: %4)";
-        post_request_header += "\r\n\r\n";
-
-        dohRequest.append(post_request_header.arg(path).arg(hostname).arg(userAgent).arg(dns.req.size()));
-        dohRequest.append(dns.req);
+        qDebug() << "Too many queries waiting on a certificate for provider:" << providerName << "failing this one right away";
+        QByteArray servfail = DNSCrypt::servfailFor(dns);
+        emit decryptedLookupDoneSendResponseNow(servfail, dns);
+        return;
     }
 
-    DoHDoTLSResponse *d = new DoHDoTLSResponse(dns, dohRequest);
-    if(d)
+    queuedForValidation.append(dns);
+    qDebug() << "Waiting on a certificate for provider:" << providerName << "queued queries:" << queuedForValidation.size();
+    if(!pendingValidation)
+        getValidServerCertificate();
+}
+
+void DNSCryptSession::validationTimedOut()
+{
+    qDebug() << "Couldn't get a valid certificate in time from provider:" << providerName << "failing the queries waiting on it";
+    pendingValidation = false;
+    holder->nextRefresh = DNSCrypt::getTimeNow() + DNSCRYPT_CERT_RETRY_SECS;
+    holder->usedSinceRefresh = true; //So the refresh is retried even if the certificates it has are still good
+
+    QVector<DNSInfo> queue;
+    queue.swap(queuedForValidation);
+    for(DNSInfo &dns : queue)
     {
-        connect(d, &DoHDoTLSResponse::decryptedLookupDoneSendResponseNow, this, &DNSCrypt::decryptedLookupDoneSendResponseNow);
-        d->tls.setPeerVerifyName(hostname);
-        if(currentServer.isNull())
-            d->tls.connectToHostEncrypted(hostname, currentPort);
-        else
-        {
-            connect(&d->tls, SIGNAL(connected()), d, SLOT(startEncryption()));
-            d->tls.connectToHost(currentServer, currentPort);
-        }
+        QByteArray servfail = DNSCrypt::servfailFor(dns);
+        emit decryptedLookupDoneSendResponseNow(servfail, dns);
     }
 }
 
-void DNSCrypt::makeEncryptedRequest(DNSInfo &dns)
+void DNSCryptSession::makeEncryptedRequest(DNSInfo &dns, bool newKey)
 {
+    newKeyPerRequest = newKey;
     if(protocolVersion == 1)
     {
-        CertificateHolder *c = getCachedCert(currentServer, providerName);
-        if(c != nullptr && !pendingValidation)
+        const SignedBincertFields *cert = holder->currentCertificate(DNSCrypt::getTimeNow());
+        if(cert != nullptr)
         {
-            currentCert = c->bincertFields;
-            if(getTimeNow() > currentCert.ts_end)
-            {
-                qDebug() << "Certificate is no longer valid, requesting a fresh one! For provider:" << providerName;
-                getValidServerCertificate(dns);
-                return;
-            }
-
-            qDebug() << "Alright now let's encrypt :) current server:" << currentServer << "current provider:" << providerName;
-            emit certificateVerifiedDoEncryptedLookup(currentCert, currentServer, currentPort, newKeyPerRequest, dns);
+            holder->usedSinceRefresh = true;
+            qDebug() << "Alright now let's encrypt :) server:" << server << "provider:" << providerName;
+            holder->certificateVerifiedDoEncryptedLookup(*cert, server, port, newKeyPerRequest, dns);
+            return;
         }
-        else if(!pendingValidation)
-            getValidServerCertificate(dns);
+
+        if(!holder->certificates.isEmpty())
+            qDebug() << "Certificate is no longer valid, requesting a fresh one! For provider:" << providerName;
+        queueForValidation(dns);
     }
     else if(protocolVersion == 2)
     {
-        sendDoHDoTLS(dns, DNSCryptProtocol::DNSoverHTTPS);
+        sendDoH(dns);
     }
     else if(protocolVersion == 3)
     {
-        sendDoHDoTLS(dns, DNSCryptProtocol::DNSoverTLS);
+        sendDoT(dns);
     }
 }
 
-void DNSCrypt::setProvider(QString dnscryptStamp)
+void DNSCryptSession::sendDoH(DNSInfo &dns)
 {
-    if(dnscryptStamp == currentStamp) return;
-
-    DNSCryptProvider newProvider(dnscryptStamp.toUtf8());
-    protocolVersion = newProvider.protocolVersion;
-    if(protocolVersion == 0) return;
-
-    hostname = newProvider.hostname;
-    path = newProvider.path;
-    currentPort = newProvider.port;
-
-    //Because of stamp specification note, I resolve the ip to use from hostname if addr is empty or just a port (I take the port and set it empty in that case):
-    //"addr is the IP address of the server. It can be an empty string, or just a port number. In that case, the host name will be resolved to an IP address using another resolver."
-    if(newProvider.addr.size() == 0)
+    //The least busy connection, another one's only opened when every one of them already has all it'll take in flight
+    DoHConnection *connection = nullptr;
+    for(DoHConnection *c : dohConnections)
     {
-        //Note: connectToHostEncrypted with hostname is used instead of connectToHost with ip when currentServer is null, which results in resolving it automatically,
-        //and using this server itself if system dns is set to use it.
-        currentServer.clear();
+        if(connection == nullptr || c->outstanding() < connection->outstanding())
+            connection = c;
     }
-    else
-        currentServer = QHostAddress(newProvider.addr);
-
-    if(protocolVersion == 1)
+    if(connection == nullptr || (connection->busy() && dohConnections.size() < DOH_POOL_SIZE))
     {
-        providerName = newProvider.providerName;
-        if(newProvider.providerPubKey.size() == crypto_box_PUBLICKEYBYTES)
-            memcpy(providerKey, newProvider.providerPubKey.data(), crypto_box_PUBLICKEYBYTES);
-
-        emit displayLastUsedProvider(newProvider.props, providerName, currentServer, currentPort);
+        connection = new DoHConnection(hostname, path, server, port, userAgent);
+        connect(connection, &DoHConnection::decryptedLookupDoneSendResponseNow, this, &DNSCryptSession::decryptedLookupDoneSendResponseNow);
+        dohConnections.append(connection);
     }
-    else if(protocolVersion == 2 || protocolVersion == 3)
+    connection->query(dns);
+}
+
+void DNSCryptSession::sendDoT(DNSInfo &dns)
+{
+    if(dotConnection == nullptr)
     {
-        emit displayLastUsedProvider(newProvider.props, hostname, currentServer, currentPort);
+        dotConnection = new DoTConnection(hostname, server, port);
+        connect(dotConnection, &DoTConnection::decryptedLookupDoneSendResponseNow, this, &DNSCryptSession::decryptedLookupDoneSendResponseNow);
     }
+    dotConnection->query(dns);
+}
 
-    currentStamp = dnscryptStamp;
-    qDebug() << "Provider set!";
+int DNSCrypt::beforenm(quint8 *sharedKey, const quint8 *serverPK, const quint8 *sk, quint32 esVersion)
+{
+#ifdef DNSCRYPT_HAVE_XCHACHA20
+    if(esVersion == DNSCRYPT_ES_XCHACHA20)
+        return crypto_box_curve25519xchacha20poly1305_beforenm(sharedKey, serverPK, sk);
+#else
+    Q_UNUSED(esVersion);
+#endif
+    return crypto_box_beforenm(sharedKey, serverPK, sk);
+}
+
+int DNSCrypt::seal(quint8 *out, const quint8 *msg, quint64 len, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion)
+{
+#ifdef DNSCRYPT_HAVE_XCHACHA20
+    if(esVersion == DNSCRYPT_ES_XCHACHA20)
+        return crypto_box_curve25519xchacha20poly1305_easy_afternm(out, msg, len, nonce, sharedKey);
+#else
+    Q_UNUSED(esVersion);
+#endif
+    return crypto_box_easy_afternm(out, msg, len, nonce, sharedKey);
+}
+
+int DNSCrypt::open(quint8 *out, const quint8 *sealed, quint64 len, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion)
+{
+#ifdef DNSCRYPT_HAVE_XCHACHA20
+    if(esVersion == DNSCRYPT_ES_XCHACHA20)
+        return crypto_box_curve25519xchacha20poly1305_open_easy_afternm(out, sealed, len, nonce, sharedKey);
+#else
+    Q_UNUSED(esVersion);
+#endif
+    return crypto_box_open_easy_afternm(out, sealed, len, nonce, sharedKey);
+}
+
+quint32 DNSCrypt::preferredESVersion()
+{
+    //When a provider has certificates for both constructions, use whichever one this CPU runs faster.
+    //Timed once per process over a typical padded query's worth of data, sealing and opening it like a lookup does
+#ifndef DNSCRYPT_HAVE_XCHACHA20
+    return DNSCRYPT_ES_XSALSA20;
+#else
+    static const quint32 preferred = []() -> quint32
+    {
+        quint8 key[crypto_box_BEFORENMBYTES], nonce[crypto_box_NONCEBYTES];
+        quint8 msg[256], sealed[256 + crypto_box_MACBYTES];
+        randombytes_buf(key, sizeof key);
+        randombytes_buf(nonce, sizeof nonce);
+        randombytes_buf(msg, sizeof msg);
+
+        qint64 nsecs[3] = {0, 0, 0};
+        for(quint32 es = DNSCRYPT_ES_XSALSA20; es <= DNSCRYPT_ES_XCHACHA20; es++)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            for(int i = 0; i < 2000; i++)
+            {
+                seal(sealed, msg, sizeof msg, nonce, key, es);
+                open(msg, sealed, sizeof sealed, nonce, key, es);
+            }
+            nsecs[es] = timer.nsecsElapsed();
+        }
+
+        quint32 faster = (nsecs[DNSCRYPT_ES_XCHACHA20] < nsecs[DNSCRYPT_ES_XSALSA20]) ? DNSCRYPT_ES_XCHACHA20 : DNSCRYPT_ES_XSALSA20;
+        qDebug() << "XSalsa20Poly1305:" << nsecs[DNSCRYPT_ES_XSALSA20] / 2000 << "ns/query, XChaCha20Poly1305:" << nsecs[DNSCRYPT_ES_XCHACHA20] / 2000
+                 << "ns/query, preferring" << (faster == DNSCRYPT_ES_XCHACHA20 ? "XChaCha20" : "XSalsa20") << "certificates";
+        return faster;
+    }();
+    return preferred;
+#endif
 }
 
 quint64 DNSCrypt::getTimeNow()
@@ -303,15 +434,18 @@ quint64 DNSCrypt::getTimeNow()
     return nowStr.toULongLong();
 }
 
-void DNSCrypt::validateCertificates()
+void DNSCryptSession::validateCertificates()
 {
     QByteArray datagram;
     QHostAddress sender;
     quint16 senderPort;
-    bool foundMagic = false;
-    int magicOffset = 0;
-    SignedBincert bincert;
-    SignedBincertFields bincertFields;
+
+    if(!pendingValidation)
+    {
+        while(udp.hasPendingDatagrams())
+            udp.readDatagram(nullptr, 0);
+        return;
+    }
 
     while(udp.hasPendingDatagrams())
     {
@@ -320,67 +454,53 @@ void DNSCrypt::validateCertificates()
 
         qDebug() << "TXT record response with certificate to validate:" << datagram;
 
-        for(int i = 0; i < (datagram.size() - 5); i++)
+        //Providers often publish a certificate for each construction, and a couple of serials while they rotate,
+        //every one of a version we support gets its signature checked
+        QVector<SignedBincert> candidates;
+        for(int i = datagram.indexOf(CERT_MAGIC_CERT); i != -1; i = datagram.indexOf(CERT_MAGIC_CERT, i + CERT_MAGIC_LEN))
         {
-            if(memcmp(&datagram.data()[i], CERT_MAGIC_CERT, 5) == 0)
-            {
-                foundMagic = true;
-                magicOffset = i;
+            SignedBincert bincert;
+            if((quint32)(datagram.size() - i) < sizeof bincert)
                 break;
-            }
-        }
 
-        if(foundMagic)
-        {
-            datagram.remove(0, magicOffset);
             qDebug() << "We have the magic!";
-        }
-        else
-        {
-            qDebug() << "Cert magic not found...";
-            continue;
-        }
-
-        memcpy(&bincert, datagram.data(), sizeof bincert);
-        bincert.version_major = qFromBigEndian(bincert.version_major);
-        bincert.version_minor = qFromBigEndian(bincert.version_minor);
-
-        // Version indicates which crypto construction to use
-        // For X25519-XSalsa20Poly1305, <es-version> must be 0x00 0x01.
-        // For X25519-XChacha20Poly1305, <es-version> must be 0x00 0x02.
-        if(bincert.version_major == 1)
-        {
-            qDebug() << "Verifying XSalsa20 cert...";
-            if(crypto_sign_ed25519_verify_detached(bincert.signature, bincert.signed_data, sizeof bincert.signed_data, providerKey) != 0)
-            {
-                /* Incorrect signature! */
-                qDebug() << "Incorrect signature...";
-                continue;
-            }
-        }
-        else if(bincert.version_major == 2)
-        {
-            qDebug() << "Verifying XChacha20 cert"; //Idk? What do I call differently?
-            if(crypto_sign_ed25519_verify_detached(bincert.signature, bincert.signed_data, sizeof bincert.signed_data, providerKey) != 0)
+            memcpy(&bincert, &datagram.data()[i], sizeof bincert);
+            bincert.version_major = qFromBigEndian(bincert.version_major);
+            bincert.version_minor = qFromBigEndian(bincert.version_minor);
+
+            // Version indicates which crypto construction to use
+            // For X25519-XSalsa20Poly1305, <es-version> must be 0x00 0x01.
+            // For X25519-XChacha20Poly1305, <es-version> must be 0x00 0x02.
+            bool supported = (bincert.version_major == DNSCRYPT_ES_XSALSA20);
+#ifdef DNSCRYPT_HAVE_XCHACHA20
+            supported |= (bincert.version_major == DNSCRYPT_ES_XCHACHA20);
+#endif
+            if(!supported)
             {
-                /* Incorrect signature! */
-                qDebug() << "Incorrect signature...";
+                qDebug() << "Invalid version, either XSalsa or XChacha there isn't another one supported! lol";
                 continue;
             }
+            candidates.append(bincert);
         }
-        else
+
+        if(candidates.isEmpty())
         {
-            qDebug() << "Invalid version, either XSalsa or XChacha there isn't another one supported! lol";
+            qDebug() << "No usable cert in this response...";
             continue;
         }
 
-        memcpy(&bincertFields, bincert.signed_data, sizeof bincert.signed_data);
-        bincertFields.ts_begin = qFromBigEndian(bincertFields.ts_begin);
-        bincertFields.ts_end = qFromBigEndian(bincertFields.ts_end);
-        bincertFields.serial = qFromBigEndian(bincertFields.serial);
+        //Ed25519 verification is the slowest thing a lookup ever waits on, it's done on a crypto worker instead of this event loop
+        DNSCrypt::cryptoWorkers()->start(new CertificateVerifier(this, candidates, providerKey));
+    }
+}
 
-        quint64 now = getTimeNow();
-        qDebug() << "Current serial:" << currentCert.serial << "This serial:" << bincertFields.serial;
+void DNSCryptSession::certificatesVerified(QVector<SignedBincertFields> verified)
+{
+    int validCerts = 0;
+    quint64 now = DNSCrypt::getTimeNow();
+    for(const SignedBincertFields &bincertFields : verified)
+    {
+        qDebug() << "Certificate serial:" << bincertFields.serial << "es-version:" << bincertFields.esVersion;
 
         if(now < bincertFields.ts_begin)
         {
@@ -392,56 +512,248 @@ void DNSCrypt::validateCertificates()
             qDebug() << "Certificate is no longer valid";
             continue;
         }
-        else if(bincertFields.serial < currentCert.serial)
+
+        holder->addCertificate(bincertFields, now);
+        validCerts++;
+    }
+
+    //A late answer to a fetch that already timed out still leaves its certificates for next time
+    if(!pendingValidation)
+        return;
+
+    const SignedBincertFields *cert = holder->currentCertificate(now);
+    if(validCerts == 0 || cert == nullptr)
+    {
+        qDebug() << "No usable cert in this response...";
+        return;
+    }
+
+    qDebug() << "Valid cert!!! We have successfully validated the server's certificate, we're good to encrypt! es-version:" << cert->esVersion << "serial:" << cert->serial;
+    pendingValidation = false;
+    validationTimer.stop();
+    //Half way to expiry, but at least every few hours so new serials get picked up before the old ones go
+    holder->nextRefresh = now + qMax((quint64)DNSCRYPT_CERT_RETRY_SECS, qMin((quint64)DNSCRYPT_CERT_REFRESH_SECS, (cert->ts_end - now) / 2));
+
+    //Everyone who was waiting on this certificate goes out now
+    QVector<DNSInfo> queue;
+    queue.swap(queuedForValidation);
+    qDebug() << "Sending" << queue.size() << "queries that were waiting on this certificate";
+    for(DNSInfo &dns : queue)
+        holder->certificateVerifiedDoEncryptedLookup(*cert, server, port, newKeyPerRequest, dns);
+}
+
+CertificateVerifier::CertificateVerifier(DNSCryptSession *session, const QVector<SignedBincert> &candidates, const quint8 *providerKey)
+{
+    this->session = session;
+    this->candidates = candidates;
+    stage = CryptoStage::forThisThread();
+    memcpy(this->providerKey, providerKey, sizeof this->providerKey);
+}
+
+void CertificateVerifier::run()
+{
+    QVector<SignedBincertFields> verified;
+    for(SignedBincert &bincert : candidates)
+    {
+        qDebug() << "Verifying" << (bincert.version_major == DNSCRYPT_ES_XCHACHA20 ? "XChacha20" : "XSalsa20") << "cert...";
+        if(crypto_sign_ed25519_verify_detached(bincert.signature, bincert.signed_data, sizeof bincert.signed_data, providerKey) != 0)
         {
-            qDebug() << "Certificates serial is old, old serial:" << bincertFields.serial << "Current serial:" << currentCert.serial;
+            /* Incorrect signature! */
+            qDebug() << "Incorrect signature...";
             continue;
         }
-        currentCert = bincertFields;
 
-        qDebug() << "Valid cert!!! We have successfully validated the server's certificate, we're good to encrypt!";
-        emit certificateVerifiedDoEncryptedLookup(bincertFields, currentServer, currentPort, newKeyPerRequest);
-        emit deleteOldCertificatesForProvider(providerName, currentServer, bincertFields);
-        pendingValidation = false;
+        SignedBincertFields bincertFields;
+        memset(&bincertFields, 0, sizeof bincertFields);
+        memcpy(&bincertFields, bincert.signed_data, sizeof bincert.signed_data);
+        bincertFields.ts_begin = qFromBigEndian(bincertFields.ts_begin);
+        bincertFields.ts_end = qFromBigEndian(bincertFields.ts_end);
+        bincertFields.serial = qFromBigEndian(bincertFields.serial);
+        bincertFields.esVersion = bincert.version_major;
+        verified.append(bincertFields);
+    }
+
+    //The one time construction benchmark runs here too, so picking a certificate on the event loop never has to wait on it
+    DNSCrypt::preferredESVersion();
+
+    //Posted through the session thread's stage, which this keeps alive, and only checked there: the session itself can be pruned
+    //or its whole server thread shut down while this ran, then the certificates are just dropped
+    QPointer<DNSCryptSession> s = session;
+    QMetaObject::invokeMethod(stage.data(), [s, verified]() {
+        if(s)
+            s->certificatesVerified(verified);
+    }, Qt::QueuedConnection);
+}
+
+QThreadPool *DNSCrypt::cryptoWorkers()
+{
+    //Shared by every server thread's DNSCrypt
+    static QThreadPool *workers = []()
+    {
+        QThreadPool *pool = new QThreadPool();
+        pool->setMaxThreadCount(qBound(1, QThread::idealThreadCount() / 2, DNSCRYPT_CRYPTO_WORKERS_MAX));
+        return pool;
+    }();
+    return workers;
+}
+
+static QAtomicInt cryptoOffload(0);
+
+void DNSCrypt::setCryptoWorkerThreads(int threads)
+{
+    //0 keeps seal/open inline on each server thread, certificate checks go to the workers either way
+    cryptoOffload.storeRelease(threads > 0 ? 1 : 0);
+    cryptoWorkers()->setMaxThreadCount(threads > 0 ? threads : qBound(1, QThread::idealThreadCount() / 2, DNSCRYPT_CRYPTO_WORKERS_MAX));
+}
+
+bool DNSCrypt::cryptoOffloaded()
+{
+    return cryptoOffload.loadAcquire() != 0;
+}
+
+CryptoJob::CryptoJob(bool opening, const QByteArray &in, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion)
+{
+    this->opening = opening;
+    this->in = in;
+    this->esVersion = esVersion;
+    memcpy(this->nonce, nonce, sizeof this->nonce);
+    memcpy(this->sharedKey, sharedKey, sizeof this->sharedKey);
+    ok = false;
+    next = nullptr;
+}
+
+CryptoJob::~CryptoJob()
+{
+    sodium_memzero(sharedKey, sizeof sharedKey);
+}
+
+void CryptoJob::run()
+{
+    if(opening)
+    {
+        if((quint32)in.size() < crypto_box_MACBYTES)
+            return;
+        out.resize(in.size() - crypto_box_MACBYTES);
+        ok = (DNSCrypt::open((quint8*)out.data(), (const quint8*)in.constData(), in.size(), nonce, sharedKey, esVersion) == 0);
+    }
+    else
+    {
+        out.resize(in.size() + crypto_box_MACBYTES);
+        ok = (DNSCrypt::seal((quint8*)out.data(), (const quint8*)in.constData(), in.size(), nonce, sharedKey, esVersion) == 0);
+    }
+}
+
+CryptoStage::CryptoStage(QObject *parent)
+{
+    Q_UNUSED(parent);
+}
+
+CryptoStage::~CryptoStage()
+{
+    qDeleteAll(pending);
+    CryptoJob *job = done.fetchAndStoreOrdered(nullptr);
+    while(job != nullptr)
+    {
+        CryptoJob *next = job->next;
+        delete job;
+        job = next;
+    }
+}
+
+void CryptoStage::process(CryptoJob *job)
+{
+    if(!DNSCrypt::cryptoOffloaded())
+    {
+        job->run();
+        job->then(*job);
+        delete job;
         return;
     }
+
+    forThisThread()->submit(job);
 }
 
-void DNSCrypt::deleteOldCertificatesForProvider(QString provider, QHostAddress server, SignedBincertFields newestCert)
+QSharedPointer<CryptoStage> CryptoStage::forThisThread()
 {
-    bool isDuplicate = false;
-    for(int i = 0; i < certCache.size(); i++)
+    //Workers hold a reference while their batch (or certificate check) is out, so it's deleted on its own thread only after the last one's back.
+    //The thread's own reference goes when the thread exits, its event loop's done by then so it's deleted right there
+    static QThreadStorage<QSharedPointer<CryptoStage>> stages;
+    if(!stages.hasLocalData())
     {
-        if((certCache.at(i)->providerName == provider && certCache.at(i)->certServer == server))
-        {
-            if(memcmp(&certCache.at(i)->bincertFields, &newestCert, sizeof(SignedBincertFields)) == 0)
-            {
-                if(!isDuplicate)
-                    isDuplicate = true;
-                else
-                {
-                    qDebug() << "Deleting duplicate certificate, for provider:" << provider << "server:" << server << "cert serial:" << newestCert.serial;
-                    CertificateHolder *cr = certCache.at(i);
-                    certCache.remove(i);
-                    delete cr;
-                    i--;
-                    continue;
-                }
-            }
+        stages.setLocalData(QSharedPointer<CryptoStage>(new CryptoStage(), [](CryptoStage *stage) {
+            if(stage->thread() == QThread::currentThread())
+                delete stage;
+            else
+                stage->deleteLater();
+        }));
+    }
+    return stages.localData();
+}
 
-            if(newestCert.serial > certCache.at(i)->bincertFields.serial)
-            {
-                qDebug() << "Deleting certificate, for provider:" << provider << "newer serial:" << newestCert.serial << "older:" << certCache.at(i)->bincertFields.serial;
-                CertificateHolder *cr = certCache.at(i);
-                certCache.remove(i);
-                delete cr;
-                i--;
-            }
-        }
+void CryptoStage::submit(CryptoJob *job)
+{
+    pending.append(job);
+    if(pending.size() == 1)
+        QMetaObject::invokeMethod(this, [this]() { dispatch(); }, Qt::QueuedConnection);
+}
+
+void CryptoStage::dispatch()
+{
+    //Split evenly so every worker gets a share of a burst
+    QThreadPool *workers = DNSCrypt::cryptoWorkers();
+    int batches = qMin(pending.size(), qMax(1, workers->maxThreadCount())), from = 0;
+    for(int b = 1; b <= batches; b++)
+    {
+        int to = pending.size() * b / batches;
+        workers->start(new CryptoBatch(sharedFromThis(), pending.mid(from, to - from)));
+        from = to;
+    }
+    pending.clear();
+}
+
+void CryptoStage::finished(CryptoJob *first, CryptoJob *last)
+{
+    //Only the push that finds the list empty posts a wakeup, the drain it triggers takes whatever's been pushed by then
+    CryptoJob *head;
+    do
+    {
+        head = done.loadAcquire();
+        last->next = head;
+    } while(!done.testAndSetOrdered(head, first));
+
+    if(head == nullptr)
+        QMetaObject::invokeMethod(this, [this]() { drain(); }, Qt::QueuedConnection);
+}
+
+void CryptoStage::drain()
+{
+    CryptoJob *job = done.fetchAndStoreOrdered(nullptr);
+    while(job != nullptr)
+    {
+        CryptoJob *next = job->next;
+        job->then(*job);
+        delete job;
+        job = next;
+    }
+}
+
+CryptoBatch::CryptoBatch(QSharedPointer<CryptoStage> stage, const QVector<CryptoJob*> &jobs)
+{
+    this->stage = stage;
+    this->jobs = jobs;
+}
+
+void CryptoBatch::run()
+{
+    for(int i = 0; i < jobs.size(); i++)
+    {
+        jobs[i]->run();
+        jobs[i]->next = (i + 1 < jobs.size()) ? jobs[i + 1] : nullptr;
     }
+    stage->finished(jobs.first(), jobs.last());
 }
 
-EncryptedResponse::EncryptedResponse(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sk, QObject *parent)
+EncryptedResponse::EncryptedResponse(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sharedKey, QObject *parent)
 {
     Q_UNUSED(parent);
 
@@ -450,14 +762,13 @@ EncryptedResponse::EncryptedResponse(DNSInfo &dns, QByteArray encryptedRequest,
     providerName = providername;
     bincertFields = signedBincertFields;
     responseHandled = false;
-    memcpy(this->sk, sk, crypto_box_SECRETKEYBYTES);
+    memcpy(this->sharedKey, sharedKey, crypto_box_BEFORENMBYTES);
     memcpy(this->nonce, nonce, crypto_box_NONCEBYTES);
 
     connect(&tcp, SIGNAL(disconnected()), this, SLOT(deleteLater()));
     connect(&tcp, SIGNAL(connected()), this, SLOT(writeEncryptedRequestTCP()));
     connect(&tcp, SIGNAL(readyRead()), this, SLOT(getAndDecryptResponseTCP()));
-    connect(&udp, SIGNAL(readyRead()), this, SLOT(getAndDecryptResponse()));
-    connect(&udp, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &EncryptedResponse::socketError);
+    connect(&tcp, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &EncryptedResponse::socketError);
 }
 
 void EncryptedResponse::socketError(QAbstractSocket::SocketError error)
@@ -498,7 +809,7 @@ void EncryptedResponse::getAndDecryptResponseTCP()
     if(responseHandled) return;
 
     dnsCryptResponseHeader responseHeader;
-    QByteArray packet = tcp.readAll(), decrypted;
+    QByteArray packet = tcp.readAll();
 
     qDebug() << "Received encrypted TCP packet:" << packet << "with size:" << packet.size();
     if((quint32)packet.size() < sizeof responseHeader)
@@ -518,107 +829,248 @@ void EncryptedResponse::getAndDecryptResponseTCP()
     {
         qDebug() << "We still have the magic over TCP! :)";
 
-        if(memcmp(&responseHeader.ClientNonce, nonce, sizeof(crypto_box_HALF_NONCEBYTES)) != 0)
+        if(sodium_memcmp(&responseHeader.ClientNonce, nonce, crypto_box_HALF_NONCEBYTES) != 0)
         {
             qDebug() << "Unexpected nonce...";
             return endResponse();
         }
 
-        quint32 decryptedLen = prependedPacketLen - crypto_box_MACBYTES;
-        decrypted.resize(decryptedLen);
         memcpy(&nonce[crypto_box_HALF_NONCEBYTES], &responseHeader.ServerNonce, crypto_box_HALF_NONCEBYTES);
+        packet.truncate(prependedPacketLen);
+        return openResponse(packet, true);
+    }
+}
 
-        QByteArray response;
-        if(crypto_box_open_easy((quint8*)decrypted.data(), (quint8*)packet.data(), packet.size(), nonce, bincertFields.server_publickey, sk) != 0)
+void EncryptedResponse::decryptResponse(QByteArray datagram)
+{
+    if(responseHandled) return;
+
+    dnsCryptResponseHeader responseHeader;
+
+    qDebug() << "Received encrypted UDP datagram:" << datagram << "with size:" << datagram.size();
+
+    if((quint32)datagram.size() < sizeof responseHeader + crypto_box_MACBYTES)
+    {
+        qDebug() << "Datagram too small...";
+        return endResponse();
+    }
+
+    memcpy(&responseHeader, datagram.data(), sizeof responseHeader);
+    datagram.remove(0, sizeof responseHeader);
+
+    if(memcmp(&responseHeader.ServerMagic, DNSCRYPT_MAGIC_RESPONSE, sizeof responseHeader.ServerMagic) == 0)
+    {
+        qDebug() << "We still have the magic! :)";
+
+        if(sodium_memcmp(&responseHeader.ClientNonce, nonce, crypto_box_HALF_NONCEBYTES) != 0)
         {
-            qDebug() << "Decryption failed..." << response;
+            qDebug() << "Unexpected nonce...";
             return endResponse();
         }
 
-        response.append(decrypted);
-        removePadding(response);
-        emit decryptedLookupDoneSendResponseNow(response, respondTo);
+        memcpy(&nonce[crypto_box_HALF_NONCEBYTES], &responseHeader.ServerNonce, crypto_box_HALF_NONCEBYTES);
+        return openResponse(datagram, false);
+    }
+    return endResponse();
+}
+
+void EncryptedResponse::openResponse(const QByteArray &sealed, bool overTCP)
+{
+    //Anything else that turns up for this query while it's being opened is ignored
+    responseHandled = true;
+
+    QPointer<EncryptedResponse> response(this);
+    CryptoJob *job = new CryptoJob(true, sealed, nonce, sharedKey, bincertFields.esVersion);
+    job->then = [response, overTCP](CryptoJob &job) {
+        if(response)
+            response->responseOpened(job.ok, job.out, overTCP);
+    };
+    CryptoStage::process(job);
+}
+
+void EncryptedResponse::responseOpened(bool opened, QByteArray decrypted, bool overTCP)
+{
+    if(!opened)
+    {
+        qDebug() << "Not decrypted...";
         return endResponse();
     }
+
+    if(!overTCP && decrypted.size() >= DNS_HEADER_SIZE)
+    {
+        if(((DNS_HEADER*)decrypted.data())->tc == 1)
+        {
+            qDebug() << "TCFlag set / truncated message, using tcp for this request:" << encRequest;
+            emit resendUsingTCP(respondTo, encRequest, bincertFields, providerName, nonce, sharedKey);
+            return endResponse();
+        }
+    }
+
+    removePadding(decrypted);
+    emit decryptedLookupDoneSendResponseNow(decrypted, respondTo);
+    endResponse();
 }
 
-void EncryptedResponse::getAndDecryptResponse()
+CertificateHolder::CertificateHolder(QString stamp, QString providername, QHostAddress server, quint16 port, QObject *parent)
 {
-    if(responseHandled) return;
+    Q_UNUSED(parent);
+    memset(&bincertFields, 0, sizeof bincertFields);
+    providerStamp = stamp;
+    nextRefresh = 0;
+    usedSinceRefresh = false;
+    providerName = providername;
+    usingTCP = false;
+    certServer = server;
+    serverPort = port;
+    nextRotateKeyTime = QDateTime::currentDateTime().currentMSecsSinceEpoch() + (randombytes_random() % 86400000);
+    keypairPool = nullptr;
+    newKeypair();
 
-    QByteArray datagram, decrypted;
-    QHostAddress sender;
-    quint16 senderPort;
+    nextPoolSocket = 0;
+    connect(&responseTimeoutTimer, &QTimer::timeout, this, &CertificateHolder::expireAwaitingResponses);
+    responseTimeoutTimer.start(1000);
+}
 
-    while(udp.hasPendingDatagrams())
+void CertificateHolder::sendUDP(EncryptedResponse *er, const QByteArray &encryptedRequest, const quint8 *clientNonce, const QHostAddress &server, quint16 port)
+{
+    if(udpPool.size() < (int)DNSCRYPT_UDP_POOL_SIZE)
     {
-        dnsCryptResponseHeader responseHeader;
+        //Made as they're first needed, each one binds its ephemeral port on the first write and keeps it
+        QUdpSocket *udp = new QUdpSocket(this);
+        connect(udp, &QUdpSocket::readyRead, this, [this, udp]() { readPooledResponses(udp); });
+        udpPool.append(udp);
+    }
 
-        datagram.resize(udp.pendingDatagramSize());
-        udp.readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
+    AwaitingResponse awaiting;
+    awaiting.response = er;
+    awaiting.deadline = QDateTime::currentMSecsSinceEpoch() + DNSCRYPT_QUERY_TIMEOUT_MS;
+    awaitingResponses.insert(QByteArray((const char*)clientNonce, crypto_box_HALF_NONCEBYTES), awaiting);
+
+    QUdpSocket *udp = udpPool[nextPoolSocket++ % udpPool.size()];
+    udp->writeDatagram(encryptedRequest, server, port);
+}
 
-        qDebug() << "Received encrypted UDP datagram:" << datagram << "with size:" << datagram.size();
+void CertificateHolder::readPooledResponses(QUdpSocket *udp)
+{
+    QByteArray datagram;
+    QHostAddress sender;
+    quint16 senderPort;
 
+    while(udp->hasPendingDatagrams())
+    {
+        datagram.resize(udp->pendingDatagramSize());
+        udp->readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
 
-        if((quint32)datagram.size() < sizeof responseHeader)
+        dnsCryptResponseHeader responseHeader;
+        if((quint32)datagram.size() < sizeof responseHeader || (!certServer.isNull() && !sender.isEqual(certServer, QHostAddress::TolerantConversion)))
         {
-            qDebug() << "Datagram too small...";
-            return endResponse();
+            qDebug() << "Ignoring a datagram that isn't a response from our server:" << sender << senderPort << "size:" << datagram.size();
+            continue;
         }
 
-        memcpy(&responseHeader, datagram.data(), sizeof responseHeader);
-        datagram.remove(0, sizeof responseHeader);
-
-        if(memcmp(&responseHeader.ServerMagic, DNSCRYPT_MAGIC_RESPONSE, sizeof responseHeader.ServerMagic) == 0)
+        //Matched to its query by the client nonce it echoes back
+        memcpy(&responseHeader, datagram.constData(), sizeof responseHeader);
+        QByteArray clientNonce((const char*)responseHeader.ClientNonce, crypto_box_HALF_NONCEBYTES);
+        auto awaiting = awaitingResponses.find(clientNonce);
+        if(awaiting == awaitingResponses.end())
         {
-            qDebug() << "We still have the magic! :)";
+            qDebug() << "Response for a query that's no longer waiting (or never was), dropping it";
+            continue;
+        }
 
-            if(memcmp(&responseHeader.ClientNonce, nonce, sizeof(crypto_box_HALF_NONCEBYTES)) != 0)
+        QPointer<EncryptedResponse> er = awaiting.value().response;
+        awaitingResponses.erase(awaiting);
+        if(er)
+            er->decryptResponse(datagram);
+    }
+}
+
+void CertificateHolder::expireAwaitingResponses()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for(auto i = awaitingResponses.begin(); i != awaitingResponses.end();)
+    {
+        if(i.value().response.isNull() || now > i.value().deadline)
+        {
+            if(i.value().response)
             {
-                qDebug() << "Unexpected nonce...";
-                return endResponse();
+                qDebug() << "No response from the server in time, giving up on this encrypted query";
+                i.value().response->deleteLater();
             }
+            i = awaitingResponses.erase(i);
+        }
+        else
+            ++i;
+    }
+}
 
-            quint32 decryptedLen = datagram.size() - crypto_box_MACBYTES;
-            decrypted.resize(decryptedLen);
-            memcpy(&nonce[crypto_box_HALF_NONCEBYTES], &responseHeader.ServerNonce, crypto_box_HALF_NONCEBYTES);
+CertificateHolder::~CertificateHolder()
+{
+    delete keypairPool;
+    sodium_memzero(sk, sizeof sk);
+    sodium_memzero(sharedKey, sizeof sharedKey);
+}
 
-            QByteArray response;
-            if(crypto_box_open_easy((quint8*)decrypted.data(), (quint8*)datagram.data(), datagram.size(), nonce, bincertFields.server_publickey, sk) != 0)
-            {
-                qDebug() << "Not decrypted..." << response;
-                return endResponse();
-            }
+void CertificateHolder::newKeypair()
+{
+    crypto_box_keypair(pk, sk);
+    sharedKeyValid = false;
+}
 
-            if(decrypted.size() >= DNS_HEADER_SIZE)
-            {
-                if(((DNS_HEADER*)decrypted.data())->tc == 1)
-                {
-                    qDebug() << "TCFlag set / truncated message, using tcp for this request:" << encRequest;
-                    emit resendUsingTCP(respondTo, encRequest, bincertFields, providerName, nonce, sk);
-                    return endResponse();
-                }
-            }
+void CertificateHolder::takePooledKeypair(const SignedBincertFields &bincertFields)
+{
+    //newKeyPerRequest: one the refill thread already made (usually with its shared key too), only made here when the pool ran dry
+    if(keypairPool == nullptr)
+        keypairPool = new KeypairPool();
+    keypairPool->setServerKey(bincertFields.server_publickey, bincertFields.esVersion);
 
-            response.append(decrypted);
-            removePadding(response);
-            emit decryptedLookupDoneSendResponseNow(response, respondTo);
-            return endResponse();
+    PooledKeypair keypair;
+    if(!keypairPool->take(keypair))
+    {
+        newKeypair();
+        return;
+    }
+
+    memcpy(pk, keypair.pk, sizeof pk);
+    memcpy(sk, keypair.sk, sizeof sk);
+    sharedKeyValid = keypair.hasSharedKey;
+    if(sharedKeyValid)
+    {
+        memcpy(sharedKey, keypair.sharedKey, sizeof sharedKey);
+        memcpy(sharedKeyServerPK, keypair.serverPK, sizeof sharedKeyServerPK);
+        sharedKeyESVersion = keypair.esVersion;
+    }
+    sodium_memzero(&keypair, sizeof keypair);
+}
+
+void CertificateHolder::addCertificate(const SignedBincertFields &cert, quint64 now)
+{
+    for(int i = certificates.size() - 1; i >= 0; i--)
+    {
+        if(now > certificates[i].ts_end)
+            certificates.remove(i);
+        else if(certificates[i].serial == cert.serial && certificates[i].esVersion == cert.esVersion)
+        {
+            certificates[i] = cert; //Same one again (or a re-issue under the same serial)
+            return;
         }
     }
-    return endResponse();
+    certificates.append(cert);
 }
 
-CertificateHolder::CertificateHolder(DNSInfo &dns, QString providername, QHostAddress server, quint16 port, QObject *parent)
+const SignedBincertFields *CertificateHolder::currentCertificate(quint64 now) const
 {
-    Q_UNUSED(parent);
-    respondTo = dns;
-    providerName = providername;
-    usingTCP = false;
-    certServer = server;
-    serverPort = port;
-    nextRotateKeyTime = QDateTime::currentDateTime().currentMSecsSinceEpoch() + (randombytes_random() % 86400000);
-    crypto_box_keypair(pk, sk);
+    //The construction this CPU is faster at, then the newest serial for it
+    const SignedBincertFields *best = nullptr;
+    quint32 preferred = DNSCrypt::preferredESVersion();
+    for(const SignedBincertFields &cert : certificates)
+    {
+        if(now < cert.ts_begin || now > cert.ts_end)
+            continue;
+        if(best == nullptr || (cert.esVersion == best->esVersion ? cert.serial > best->serial : cert.esVersion == preferred))
+            best = &cert;
+    }
+    return best;
 }
 
 void CertificateHolder::addPadding(QByteArray &msg)
@@ -639,13 +1091,13 @@ void CertificateHolder::addPadding(QByteArray &msg)
     }
 }
 
-void CertificateHolder::resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sk)
+void CertificateHolder::resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sharedKey)
 {
     quint16 prependedPacketLen = encryptedRequest.size();
     prependedPacketLen = qToBigEndian(prependedPacketLen);
     encryptedRequest.prepend((const char*)&prependedPacketLen, 2);
 
-    EncryptedResponse *er2 = new EncryptedResponse(dns, encryptedRequest, signedBincertFields, providername, nonce, sk);
+    EncryptedResponse *er2 = new EncryptedResponse(dns, encryptedRequest, signedBincertFields, providername, nonce, sharedKey);
     if(er2)
     {
         connect(er2, &EncryptedResponse::decryptedLookupDoneSendResponseNow, this, &CertificateHolder::decryptedLookupDoneSendResponseNow);
@@ -656,7 +1108,7 @@ void CertificateHolder::resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest
 void CertificateHolder::certificateVerifiedDoEncryptedLookup(SignedBincertFields bincertFields, QHostAddress serverAddress, quint16 serverPort, bool newKey, DNSInfo dns)
 {
     dnsCryptQueryHeader queryHeader;
-    QByteArray unencryptedRequest, encryptedRequest, rawEncryptedRequest;
+    QByteArray unencryptedRequest;
     quint8 nonce[crypto_box_NONCEBYTES] = {0};
 
     if(serverAddress != certServer)
@@ -666,27 +1118,39 @@ void CertificateHolder::certificateVerifiedDoEncryptedLookup(SignedBincertFields
     }
 
     if(newKey)
-        crypto_box_keypair(pk, sk);
+        takePooledKeypair(bincertFields);
     else
     {
         quint64 currentTime = QDateTime::currentDateTime().currentMSecsSinceEpoch();
         if(currentTime > nextRotateKeyTime)
         {
-            crypto_box_keypair(pk, sk);
+            newKeypair();
             nextRotateKeyTime = QDateTime::currentDateTime().currentMSecsSinceEpoch() + (randombytes_random() % 86400000);
             qDebug() << "New key created! Next key rotate time:" << nextRotateKeyTime;
         }
     }
 
     this->bincertFields = bincertFields;
+    if(!sharedKeyValid || sharedKeyESVersion != bincertFields.esVersion || memcmp(sharedKeyServerPK, bincertFields.server_publickey, crypto_box_PUBLICKEYBYTES) != 0)
+    {
+        if(DNSCrypt::beforenm(sharedKey, bincertFields.server_publickey, sk, bincertFields.esVersion) != 0)
+        {
+            qDebug() << "Couldn't derive a shared key with the server's public key...";
+            return;
+        }
+        memcpy(sharedKeyServerPK, bincertFields.server_publickey, crypto_box_PUBLICKEYBYTES);
+        sharedKeyESVersion = bincertFields.esVersion;
+        sharedKeyValid = true;
+    }
+
     memset(&queryHeader, 0, sizeof queryHeader);
     memcpy(&queryHeader.ClientMagic, bincertFields.magic_query, sizeof bincertFields.magic_query);
     memcpy(&queryHeader.ClientPublicKey, pk, crypto_box_PUBLICKEYBYTES);
     randombytes_buf(&queryHeader.ClientNonce, crypto_box_HALF_NONCEBYTES);
     memcpy(nonce, &queryHeader.ClientNonce, crypto_box_HALF_NONCEBYTES);
 
-    if(dns.req.size() == 0 && respondTo.req.size() > 0) //For first request using this certificate only
-        dns.req = respondTo.req;
+    if(dns.req.size() == 0)
+        return;
 
     unencryptedRequest.append(dns.req);
     qDebug() << "Request before padding:" << unencryptedRequest << "length:" << unencryptedRequest.size();
@@ -694,17 +1158,27 @@ void CertificateHolder::certificateVerifiedDoEncryptedLookup(SignedBincertFields
     addPadding(unencryptedRequest);
     qDebug() << "Request before encryption:" << unencryptedRequest << "length:" << unencryptedRequest.size();
 
-    quint32 encryptedSize = unencryptedRequest.size() + crypto_box_MACBYTES;
-    rawEncryptedRequest.resize(encryptedSize);
+    //The job carries its own copy of the nonce and shared key, a newKeyPerRequest keypair can replace ours before it's back
+    QPointer<CertificateHolder> holder(this);
+    CryptoJob *job = new CryptoJob(false, unencryptedRequest, nonce, sharedKey, bincertFields.esVersion);
+    job->then = [holder, queryHeader, dns, bincertFields, serverAddress, serverPort](CryptoJob &job) mutable {
+        if(holder)
+            holder->sendSealed(job, queryHeader, dns, bincertFields, serverAddress, serverPort);
+    };
+    CryptoStage::process(job);
+}
 
-    if(crypto_box_easy((quint8*)rawEncryptedRequest.data(), (quint8*)unencryptedRequest.data(), unencryptedRequest.size(), nonce, bincertFields.server_publickey, sk) != 0)
+void CertificateHolder::sendSealed(CryptoJob &job, const dnsCryptQueryHeader &queryHeader, DNSInfo &dns, const SignedBincertFields &bincertFields, const QHostAddress &serverAddress, quint16 serverPort)
+{
+    if(!job.ok)
     {
         qDebug() << "Encryption failed... :(";
         return;
     }
 
-    encryptedRequest.append((char*)&queryHeader, sizeof queryHeader);
-    encryptedRequest.append(rawEncryptedRequest);
+    QByteArray encryptedRequest;
+    encryptedRequest.append((const char*)&queryHeader, sizeof queryHeader);
+    encryptedRequest.append(job.out);
 
     if(usingTCP)
     {
@@ -713,10 +1187,10 @@ void CertificateHolder::certificateVerifiedDoEncryptedLookup(SignedBincertFields
         encryptedRequest.prepend((const char*)&prependedPacketLen, 2);
     }
 
-    qDebug() << "Request after encryption:" << encryptedRequest << "size:" << encryptedRequest.size() << "encryptedSize:" << encryptedSize;
+    qDebug() << "Request after encryption:" << encryptedRequest << "size:" << encryptedRequest.size() << "encryptedSize:" << job.out.size();
     qDebug() << "Sending to server:" << serverAddress << serverPort;
 
-    EncryptedResponse *er = new EncryptedResponse(dns, encryptedRequest, bincertFields, providerName, nonce, sk);
+    EncryptedResponse *er = new EncryptedResponse(dns, encryptedRequest, bincertFields, providerName, job.nonce, job.sharedKey);
     if(er)
     {
         connect(er, &EncryptedResponse::resendUsingTCP, this, &CertificateHolder::resendUsingTCP);
@@ -725,6 +1199,6 @@ void CertificateHolder::certificateVerifiedDoEncryptedLookup(SignedBincertFields
         if(usingTCP)
             er->tcp.connectToHost(serverAddress, serverPort);
         else
-            er->udp.writeDatagram(encryptedRequest, serverAddress, serverPort);
+            sendUDP(er, encryptedRequest, job.nonce, serverAddress, serverPort);
     }
 }
@@ -11,11 +11,23 @@
 #include <QStandardPaths>
 #include <QFile>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QThreadStorage>
+#include <QSharedPointer>
+#include <functional>
 extern "C"{
 #include <sodium.h>
 }
 #include "dnsinfo.h"
 #include "buffer.h"
+#include "keypairpool.h"
+#include "upstreamconnections.h"
 
 /* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
 Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
@@ -63,10 +75,26 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 # define DNSCRYPT_MIN_PAD_LEN 8U
 #endif
 #define crypto_box_HALF_NONCEBYTES (crypto_box_NONCEBYTES / 2U)
+#define DNSCRYPT_UDP_POOL_SIZE 4
+#define DNSCRYPT_QUERY_TIMEOUT_MS 10000
+#define DNSCRYPT_VALIDATION_QUEUE_LIMIT 256
+#define DNSCRYPT_VALIDATION_TIMEOUT_MS 3000
+#define DNSCRYPT_CERT_REFRESH_SECS (4 * 3600)
+#define DNSCRYPT_CERT_RETRY_SECS 60
+#define DNSCRYPT_CRYPTO_WORKERS_MAX 4
+//opendns, used when no stamp (or only unusable ones) is configured
+#define DNSCRYPT_DEFAULT_STAMP "sdns://AQAAAAAAAAAADjIwOC42Ny4yMjAuMjIwILc1EUAgbyJdPivYItf9aR6hwzzI1maNDL4Ev6vKQ_t5GzIuZG5zY3J5cHQtY2VydC5vcGVuZG5zLmNvbQ"
 
 #define CERT_MAGIC_LEN 4U
 #define CERT_MAGIC_CERT "DNSC"
 
+//<es-version>, which construction a certificate's key is meant for
+#define DNSCRYPT_ES_XSALSA20 1
+#define DNSCRYPT_ES_XCHACHA20 2
+#ifndef SODIUM_LIBRARY_MINIMAL //Minimal libsodium builds (the Android and iOS ones here) leave out the XChaCha20 box
+# define DNSCRYPT_HAVE_XCHACHA20
+#endif
+
 // SignedBincertFields Represents the detailed structure of a DNSC certificate
 typedef struct SignedBincertFields_ {
     quint8 server_publickey[crypto_box_PUBLICKEYBYTES];
@@ -74,6 +102,7 @@ typedef struct SignedBincertFields_ {
     quint32 serial;
     quint32 ts_begin;
     quint32 ts_end;
+    quint32 esVersion; //Not part of the signed data, filled in from the certificate's version_major
 } SignedBincertFields;
 
 // SignedBincert Represents the structure of a DNSC certificate as needed to verify the signature
@@ -529,35 +558,60 @@ signals:
 
 };
 
-class DoHDoTLSResponse : public QObject
+//One seal or open. Made and finished on the server thread that wanted it, the part in between runs inline or on a crypto worker
+struct CryptoJob
+{
+    CryptoJob(bool opening, const QByteArray &in, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion);
+    ~CryptoJob();
+    void run();
+
+    bool opening, ok;
+    quint32 esVersion;
+    quint8 nonce[crypto_box_NONCEBYTES];
+    quint8 sharedKey[crypto_box_BEFORENMBYTES];
+    QByteArray in, out;
+    std::function<void(CryptoJob &job)> then;
+    CryptoJob *next;
+};
+
+//With cryptoWorkerThreads set, seal/open leave the event loop: jobs a server thread queues during one pass of it go to the crypto workers
+//as a few batches, and finished ones come back on a lock-free list the thread drains in one go. One per server thread
+class CryptoStage : public QObject, public QEnableSharedFromThis<CryptoStage>
 {
     Q_OBJECT
 public:
-    explicit DoHDoTLSResponse(DNSInfo &dns, const QByteArray &dohRequest = QByteArray(), QObject *parent = nullptr);
+    explicit CryptoStage(QObject *parent = nullptr);
+    ~CryptoStage();
+    static void process(CryptoJob *job);
+    static QSharedPointer<CryptoStage> forThisThread();
+    void finished(CryptoJob *first, CryptoJob *last); //From the workers
 
-    DNSInfo respondTo;
-    QByteArray dohrequest;
-    QSslSocket tls;
+private:
+    void submit(CryptoJob *job);
+    void dispatch();
+    void drain();
+    QVector<CryptoJob*> pending;
+    QAtomicPointer<CryptoJob> done;
+};
 
-signals:
-    void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
+class CryptoBatch : public QRunnable
+{
+public:
+    CryptoBatch(QSharedPointer<CryptoStage> stage, const QVector<CryptoJob*> &jobs);
+    void run();
 
-public slots:
-    void verifyError(const QSslError error);
-    void startEncryption();
-    void writeEncryptedDoH();
-    void getAndDecryptResponseDoH();
-    void writeEncryptedDoTLS();
-    void getAndDecryptResponseDoTLS();
+private:
+    QSharedPointer<CryptoStage> stage;
+    QVector<CryptoJob*> jobs;
 };
 
 class EncryptedResponse : public QObject
 {
     Q_OBJECT
 public:
-    explicit EncryptedResponse(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sk, QObject *parent = nullptr);
+    explicit EncryptedResponse(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sharedKey, QObject *parent = nullptr);
     void removePadding(QByteArray &msg);
-    QUdpSocket udp;
+    void decryptResponse(QByteArray datagram);
     QTcpSocket tcp;
     SignedBincertFields bincertFields;
     QString providerName;
@@ -565,84 +619,171 @@ public:
 
 private:
     void endResponse();
+    void openResponse(const QByteArray &sealed, bool overTCP);
+    void responseOpened(bool opened, QByteArray decrypted, bool overTCP);
     DNSInfo respondTo;
     QByteArray encRequest;
     bool responseHandled;
-    quint8 sk[crypto_box_SECRETKEYBYTES];
+    quint8 sharedKey[crypto_box_BEFORENMBYTES];
 
 signals:
     void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
-    void resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sk);
+    void resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sharedKey);
 
 public slots:
     void socketError(QAbstractSocket::SocketError error);
     void writeEncryptedRequestTCP();
     void getAndDecryptResponseTCP();
-    void getAndDecryptResponse();
 };
 
 class CertificateHolder : public QObject
 {
     Q_OBJECT
 public:
-    explicit CertificateHolder(DNSInfo &dns, QString providername, QHostAddress server, quint16 port, QObject *parent = nullptr);
+    explicit CertificateHolder(QString stamp, QString providername, QHostAddress server, quint16 port, QObject *parent = nullptr);
+    ~CertificateHolder();
     void addPadding(QByteArray &msg);
+    void addCertificate(const SignedBincertFields &cert, quint64 now);
+    const SignedBincertFields* currentCertificate(quint64 now) const;
     SignedBincertFields bincertFields;
-    QString providerName;
+    QString providerStamp, providerName;
     QHostAddress certServer;
     quint16 serverPort;
     quint64 nextRotateKeyTime;
+    //Every still valid certificate the server's handed us, while it rotates keys there are a couple with different serials.
+    //New queries use the best one, queries already out keep the one they were sealed with
+    QVector<SignedBincertFields> certificates;
+    quint64 nextRefresh; //In getTimeNow() seconds, fetched again in the background from then on (if it's still being used)
+    bool usedSinceRefresh;
 
 private:
-    DNSInfo respondTo;
-    bool usingTCP;
+    void newKeypair();
+    void takePooledKeypair(const SignedBincertFields &bincertFields);
+    void sendUDP(EncryptedResponse *er, const QByteArray &encryptedRequest, const quint8 *clientNonce, const QHostAddress &server, quint16 port);
+    void readPooledResponses(QUdpSocket *udp);
+    void sendSealed(CryptoJob &job, const dnsCryptQueryHeader &queryHeader, DNSInfo &dns, const SignedBincertFields &bincertFields, const QHostAddress &serverAddress, quint16 serverPort);
+    bool usingTCP, sharedKeyValid;
 
     quint8 pk[crypto_box_PUBLICKEYBYTES];
     quint8 sk[crypto_box_SECRETKEYBYTES];
+    //crypto_box_beforenm(server key, sk), so each query and reply is just the symmetric part instead of an X25519 multiplication apiece.
+    //Only good for this keypair and the server key it was made with, redone when either changes
+    quint8 sharedKey[crypto_box_BEFORENMBYTES];
+    quint8 sharedKeyServerPK[crypto_box_PUBLICKEYBYTES];
+    quint32 sharedKeyESVersion;
+    KeypairPool *keypairPool; //Made the first time newKeyPerRequest wants a keypair
+
+    //A few long lived sockets per certificate (provider + server) carry every UDP query, instead of a fresh socket each,
+    //replies get back to their query by the client nonce half they echo
+    struct AwaitingResponse
+    {
+        QPointer<EncryptedResponse> response;
+        qint64 deadline;
+    };
+    QVector<QUdpSocket*> udpPool;
+    int nextPoolSocket;
+    QHash<QByteArray, AwaitingResponse> awaitingResponses;
+    QTimer responseTimeoutTimer;
 
 signals:
     void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
-    void deleteOldCertificatesForProvider(QString provider, QHostAddress server, SignedBincertFields newestCert);
 
 public slots:
     void certificateVerifiedDoEncryptedLookup(SignedBincertFields bincertFields, QHostAddress serverAddress, quint16 serverPort, bool newKey = false, DNSInfo dns = DNSInfo());
-    void resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sk);
+    void resendUsingTCP(DNSInfo &dns, QByteArray encryptedRequest, SignedBincertFields signedBincertFields, QString providername, quint8 *nonce, quint8 *sharedKey);
+    void expireAwaitingResponses();
 };
 
-class DNSCrypt : public QObject
+//Everything a query to one provider needs: its decoded stamp, certificates, sockets and keys.
+//Sessions don't share anything that changes, so queries to any number of providers can be in flight at once
+class DNSCryptSession : public QObject
 {
     Q_OBJECT
 public:
-    explicit DNSCrypt(QObject *parent = nullptr);
+    explicit DNSCryptSession(QString dnscryptStamp, QString useragent, QObject *parent = nullptr);
+    ~DNSCryptSession();
+    bool isValid() const { return protocolVersion != 0; }
+    void makeEncryptedRequest(DNSInfo &dns, bool newKey);
+    void refreshCertificateIfDue(quint64 now);
+    void certificatesVerified(QVector<SignedBincertFields> verified);
+
+    QString stamp, providerName, hostname, path, userAgent;
+    quint8 providerKey[crypto_box_PUBLICKEYBYTES];
+    quint8 protocolVersion;
+    quint64 props;
+    quint16 port;
+    QHostAddress server;
+
+private:
     void buildTXTRecord(QByteArray &txt);
-    void getValidServerCertificate(DNSInfo &dns);
-    CertificateHolder* getCachedCert(QHostAddress server, QString provider);
-    void sendDoHDoTLS(DNSInfo &dns, DNSCryptProtocol protocol);
-    void makeEncryptedRequest(DNSInfo &dns);
-    void setProvider(QString dnscryptStamp);
-    quint64 getTimeNow();
+    void getValidServerCertificate();
+    void queueForValidation(DNSInfo &dns);
+    void sendDoH(DNSInfo &dns);
+    void sendDoT(DNSInfo &dns);
+
+    CertificateHolder *holder; //v1 only
+    QUdpSocket udp; //This provider's certificate TXT lookups
+    //Queries that came in while the certificate was being fetched wait here instead of being dropped
+    QVector<DNSInfo> queuedForValidation;
+    QTimer validationTimer;
+    bool newKeyPerRequest, pendingValidation;
+    QVector<DoHConnection*> dohConnections; //v2 only, kept open between queries
+    DoTConnection *dotConnection; //v3 only, made on first use
 
-    QSslSocket tls;
-    QUdpSocket udp;
-    QByteArray request;
-    QString providerName, hostname, path, currentStamp, userAgent;
+signals:
+    void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
+
+private slots:
+    void validateCertificates();
+    void validationTimedOut();
+};
+
+//Checks a TXT response's certificate signatures on a crypto worker, then hands the ones that passed back to the session on its own thread
+class CertificateVerifier : public QRunnable
+{
+public:
+    CertificateVerifier(DNSCryptSession *session, const QVector<SignedBincert> &candidates, const quint8 *providerKey);
+    void run();
+
+private:
+    QPointer<DNSCryptSession> session; //Made on the session's thread, only looked at there
+    QSharedPointer<CryptoStage> stage;
+    QVector<SignedBincert> candidates;
     quint8 providerKey[crypto_box_PUBLICKEYBYTES];
-    quint8 resolverMagic[DNSCRYPT_MAGIC_QUERY_LEN];
-    quint8 protocolVersion;
-    quint16 currentPort;
-    QHostAddress currentServer;
-    bool dnsCryptAvailable, dnsCryptEnabled, newKeyPerRequest, pendingValidation;
-    SignedBincertFields currentCert;
-    QVector<CertificateHolder*> certCache;
+};
+
+class DNSCrypt : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DNSCrypt(QObject *parent = nullptr);
+    ~DNSCrypt();
+    DNSCryptSession* session(const QString &dnscryptStamp);
+    void pruneSessions(const QSet<QString> &stamps);
+    void makeEncryptedRequest(DNSInfo &dns, const QString &dnscryptStamp);
+    static QByteArray servfailFor(const DNSInfo &dns);
+    static quint64 getTimeNow();
+    static quint32 preferredESVersion();
+    static QThreadPool* cryptoWorkers();
+    static void setCryptoWorkerThreads(int threads);
+    static bool cryptoOffloaded();
+
+    //Both constructions share key, nonce, MAC sizes and padding, only the cipher differs
+    static int beforenm(quint8 *sharedKey, const quint8 *serverPK, const quint8 *sk, quint32 esVersion);
+    static int seal(quint8 *out, const quint8 *msg, quint64 len, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion);
+    static int open(quint8 *out, const quint8 *sealed, quint64 len, const quint8 *nonce, const quint8 *sharedKey, quint32 esVersion);
+
+    QString userAgent, lastUsedStamp;
+    bool dnsCryptAvailable, dnsCryptEnabled, newKeyPerRequest;
+    QHash<QString, DNSCryptSession*> sessions; //By stamp, invalid ones are aliases of the default provider's session
+    QTimer certRefreshTimer;
 
 signals:
-    void certificateVerifiedDoEncryptedLookup(SignedBincertFields bincertFields, QHostAddress serverAddress, quint16 serverPort, bool newKey = false, DNSInfo dns = DNSInfo());
     void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
     void displayLastUsedProvider(quint64 props, QString providerName, QHostAddress server, quint16 port);
 
 public slots:
-    void validateCertificates();
-    void deleteOldCertificatesForProvider(QString provider, QHostAddress server, SignedBincertFields newestCert);
+    void refreshCertificates();
 };
 
 
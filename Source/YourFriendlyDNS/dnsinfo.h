@@ -34,8 +34,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define DNS_HEADER_SIZE 12
 #define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
 #define DNS_TYPE_AAAA 28
 #define DNS_TYPE_TXT 16
+#define DNS_TYPE_OPT 41
 
 #define RCODE_NOERROR 0
 #define RCODE_FMTERROR 1
@@ -97,7 +99,8 @@ public:
         answeroffset = 0;
         senderPort = 0;
         ttl = 0;
-        isValid = isResponse = hasIPs = false;
+        minTTL = negativeTTL = -1;
+        isValid = isResponse = hasIPs = prefetched = negative = false;
         expiry = QDateTime::currentDateTime();
     }
     DNSInfo(const DNSInfo &info)
@@ -120,11 +123,16 @@ public:
         this->domainString = info.domainString;
         this->answeroffset = info.answeroffset;
         this->ttl = info.ttl;
+        this->minTTL = info.minTTL;
+        this->negativeTTL = info.negativeTTL;
         this->isValid = info.isValid;
         this->isResponse = info.isResponse;
         this->hasIPs = info.hasIPs;
+        this->prefetched = info.prefetched;
+        this->negative = info.negative;
         this->ipaddresses = info.ipaddresses;
         this->expiry = info.expiry;
+        this->cachedAt = info.cachedAt;
         this->req = info.req;
         this->res = info.res;
         this->sender = info.sender;
@@ -168,9 +176,12 @@ public:
     QString domainString;
     quint16 senderPort;
     quint32 answeroffset, ttl;
-    bool isValid, isResponse, hasIPs;
+    qint32 minTTL; //Smallest TTL among a response's answers, -1 when it had none
+    qint32 negativeTTL; //For NXDOMAIN/NODATA, the authority SOA's min(TTL, MINIMUM), -1 when there wasn't one
+    bool isValid, isResponse, hasIPs, prefetched; //prefetched: the cached answer came from a background refresh, not a client's query
+    bool negative; //NXDOMAIN, or NOERROR with no answers (NODATA)
     std::vector<quint32> ipaddresses;
-    QDateTime expiry;
+    QDateTime expiry, cachedAt;
     QByteArray req, res;
     QHostAddress sender;
 };
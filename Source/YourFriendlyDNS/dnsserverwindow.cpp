@@ -34,6 +34,7 @@ DNSServerWindow::DNSServerWindow(QWidget *parent) : QMainWindow(parent), ui(new
     qRegisterMetaType<ListEntry>("ListEntry");
     qRegisterMetaType<std::vector<ListEntry>>("std::vector<ListEntry>");
     qRegisterMetaType<QHostAddress>("QHostAddress");
+    qRegisterMetaType<ServerSettingsSnapshot>("ServerSettingsSnapshot");
 
     settingspath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
     QDir d{settingspath};
@@ -53,6 +54,9 @@ DNSServerWindow::DNSServerWindow(QWidget *parent) : QMainWindow(parent), ui(new
 
     cacheviewer = new CacheViewer();
     connect(this, SIGNAL(displayCache(const std::vector<DNSInfo>&)), cacheviewer, SLOT(displayCache(const std::vector<DNSInfo>&)));
+    connect(this, &DNSServerWindow::displayCacheStats, cacheviewer, &CacheViewer::displayCacheStats);
+    connect(this, &DNSServerWindow::displayKeypairPoolStats, cacheviewer, &CacheViewer::displayKeypairPoolStats);
+    connect(this, &DNSServerWindow::displayUpstreamStats, cacheviewer, &CacheViewer::displayUpstreamStats);
 
     preloadServerPorts();
 
@@ -82,6 +86,9 @@ DNSServerWindow::DNSServerWindow(QWidget *parent) : QMainWindow(parent), ui(new
 DNSServerWindow::~DNSServerWindow()
 {
     settingsSave();
+    //Lets the server thread wind down and write out its cache snapshot
+    messagesThread->quit();
+    messagesThread->wait();
     if(settings)
         delete settings;
 
@@ -98,6 +105,8 @@ void DNSServerWindow::serversInitialized()
     connect(this, &DNSServerWindow::clearSources, settings->sourcerAndStampConverter, &providerSourcerStampConverter::clearSources);
     connect(this, &DNSServerWindow::loadSource, settings->sourcerAndStampConverter, &providerSourcerStampConverter::loadSource);
     connect(cacheviewer, &CacheViewer::deleteEntriesFromCache, server, &SmallDNSServer::deleteEntriesFromCache);
+    connect(this, &DNSServerWindow::listsChanged, server, &SmallDNSServer::compileLists);
+    connect(this, &DNSServerWindow::serverSettingsChanged, server, &SmallDNSServer::publishSettings);
 
     listeningIPsUpdate();
     settingsLoad();
@@ -186,6 +195,7 @@ void DNSServerWindow::setIPToFirstListening()
             settings->setRespondingIPv6(QHostAddress(server->listeningIPv6s[0]).toString());
             server->ipv6ToRespondWith = server->listeningIPv6s[0];
         }
+        emit serverSettingsChanged();
     }
 }
 
@@ -201,9 +211,9 @@ void DNSServerWindow::settingsUpdated()
         server->cachedMinutesValid = settings->getCachedMinutesValid();
         server->realdns = settings->returnRealDNSServers();
         server->dedicatedDNSCrypter = settings->returnDedicatedDNSCrypter();
-        server->determineDoHDoTLSProviders();
         server->dnsTTL = settings->dnsTTL;
         server->autoTTL = settings->autoTTL;
+        emit serverSettingsChanged();
     }
 }
 
@@ -300,6 +310,7 @@ void DNSServerWindow::on_firstAddButton_clicked()
 
 void DNSServerWindow::refreshList()
 {
+    emit listsChanged();
     ui->dnslist->clear();
     ui->dnslist->clear();
     if(server->whitelistmode)
@@ -359,10 +370,23 @@ bool DNSServerWindow::settingsSave()
         json["cachedMinutesValid"] = (int)server->cachedMinutesValid;
         json["dnsTTL"] = (int)server->dnsTTL;
         json["autoTTL"] = server->autoTTL;
+        json["honorUpstreamTTL"] = server->honorUpstreamTTL;
+        json["minCacheTTL"] = (int)server->minCacheTTL;
+        json["maxCacheTTL"] = (int)server->maxCacheTTL;
+        json["cacheMemoryMB"] = (int)server->cacheMemoryMB;
+        json["maxNegativeCacheTTL"] = (int)server->maxNegativeCacheTTL;
+        json["prefetchEnabled"] = server->prefetchEnabled;
+        json["prefetchFraction"] = server->prefetchFraction;
+        json["prefetchMinHits"] = (int)server->prefetchMinHits;
+        json["serveStale"] = server->serveStale;
+        json["staleAnswerDelayMs"] = (int)server->staleAnswerDelayMs;
+        json["staleMaxAge"] = (int)server->staleMaxAge;
         AppData::get()->dnsServerPort = settings->getDNSServerPort().toInt();
         json["dnsServerPort"] = AppData::get()->dnsServerPort;
         AppData::get()->httpServerPort = settings->getHTTPServerPort().toInt();
         json["httpServerPort"] = AppData::get()->httpServerPort;
+        json["dnsWorkerThreads"] = (int)AppData::get()->dnsWorkerThreads;
+        json["cryptoWorkerThreads"] = (int)AppData::get()->cryptoWorkerThreads;
         html = settings->indexhtml->getHTML();
         json["html"] = html;
 
@@ -438,6 +462,16 @@ void DNSServerWindow::preloadServerPorts()
     }
     qDebug() << "Using http server port:" << AppData::get()->httpServerPort;
 
+    if(json.contains("dnsWorkerThreads") && json["dnsWorkerThreads"].isDouble())
+        AppData::get()->dnsWorkerThreads = qBound(1, json["dnsWorkerThreads"].toInt(), 64);
+    qDebug() << "Using dns worker threads:" << AppData::get()->dnsWorkerThreads;
+
+    //Takes effect straight away, the crypto workers are shared by every server thread
+    if(json.contains("cryptoWorkerThreads") && json["cryptoWorkerThreads"].isDouble())
+        AppData::get()->cryptoWorkerThreads = qBound(0, json["cryptoWorkerThreads"].toInt(), 64);
+    DNSCrypt::setCryptoWorkerThreads(AppData::get()->cryptoWorkerThreads);
+    qDebug() << "Using crypto worker threads:" << AppData::get()->cryptoWorkerThreads;
+
     file.close();
 }
 
@@ -515,6 +549,28 @@ bool DNSServerWindow::settingsLoad()
         server->autoTTL = json["autoTTL"].toBool();
         settings->setAutoTTL(server->autoTTL);
     }
+    if(json.contains("honorUpstreamTTL") && json["honorUpstreamTTL"].isBool())
+        server->honorUpstreamTTL = json["honorUpstreamTTL"].toBool();
+    if(json.contains("minCacheTTL") && json["minCacheTTL"].isDouble())
+        server->minCacheTTL = json["minCacheTTL"].toInt();
+    if(json.contains("maxCacheTTL") && json["maxCacheTTL"].isDouble())
+        server->maxCacheTTL = json["maxCacheTTL"].toInt();
+    if(json.contains("cacheMemoryMB") && json["cacheMemoryMB"].isDouble())
+        server->cacheMemoryMB = qMax(1, json["cacheMemoryMB"].toInt());
+    if(json.contains("maxNegativeCacheTTL") && json["maxNegativeCacheTTL"].isDouble())
+        server->maxNegativeCacheTTL = json["maxNegativeCacheTTL"].toInt();
+    if(json.contains("prefetchEnabled") && json["prefetchEnabled"].isBool())
+        server->prefetchEnabled = json["prefetchEnabled"].toBool();
+    if(json.contains("prefetchFraction") && json["prefetchFraction"].isDouble())
+        server->prefetchFraction = qBound(0.5, json["prefetchFraction"].toDouble(), 1.0);
+    if(json.contains("prefetchMinHits") && json["prefetchMinHits"].isDouble())
+        server->prefetchMinHits = json["prefetchMinHits"].toInt();
+    if(json.contains("serveStale") && json["serveStale"].isBool())
+        server->serveStale = json["serveStale"].toBool();
+    if(json.contains("staleAnswerDelayMs") && json["staleAnswerDelayMs"].isDouble())
+        server->staleAnswerDelayMs = json["staleAnswerDelayMs"].toInt();
+    if(json.contains("staleMaxAge") && json["staleMaxAge"].isDouble())
+        server->staleMaxAge = json["staleMaxAge"].toInt();
 
     if(json.contains("html") && json["html"].isString())
     {
@@ -651,6 +707,7 @@ void DNSServerWindow::on_initialMode_stateChanged(int arg1)
         server->initialMode = false;
 
     qDebug() << "initial mode:" << server->initialMode;
+    emit serverSettingsChanged();
 }
 
 void DNSServerWindow::on_saveButton_clicked()
@@ -689,6 +746,7 @@ void DNSServerWindow::on_removeButton_clicked()
         }
     }
     qDeleteAll(selected);
+    emit listsChanged();
 }
 
 void DNSServerWindow::on_hostnameEdit_returnPressed()
@@ -748,6 +806,9 @@ void DNSServerWindow::on_settingsButton_clicked()
 
 void DNSServerWindow::on_cacheViewButton_clicked()
 {
-    emit displayCache(server->cachedDNSResponses);
+    emit displayCache(server->dnsCache->entries());
+    emit displayCacheStats(server->dnsCache->stats());
+    emit displayKeypairPoolStats(KeypairPool::stats());
+    emit displayUpstreamStats(UpstreamStats::current());
     cacheviewer->show();
 }
@@ -53,7 +53,12 @@ public:
 
 signals:
     void displayCache(const std::vector<DNSInfo> &cache);
+    void displayCacheStats(const DNSCacheStats &stats);
+    void displayKeypairPoolStats(const KeypairPoolStats &stats);
+    void displayUpstreamStats(const UpstreamStats &stats);
     void clearSources();
+    void listsChanged();
+    void serverSettingsChanged();
     void loadSource(QString url, bool forceUpdate = false, QByteArray hash = "", QDateTime lastUpdated = QDateTime());
 
 public slots:
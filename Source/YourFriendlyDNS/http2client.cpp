@@ -0,0 +1,490 @@
+#include "http2client.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+static quint32 readBigEndian32(const QByteArray &payload, int pos = 0)
+{
+    const uchar *p = (const uchar*)payload.constData() + pos;
+    return ((quint32)p[0] << 24) | ((quint32)p[1] << 16) | ((quint32)p[2] << 8) | (quint32)p[3];
+}
+
+Http2Client::Http2Client(const QByteArray &authority, const QByteArray &path, const QByteArray &userAgent)
+{
+    fieldValues[AUTHORITY] = authority;
+    fieldValues[PATH] = path;
+    fieldValues[ACCEPT] = fieldValues[CONTENT_TYPE] = "application/dns-message";
+    fieldValues[USER_AGENT] = userAgent;
+    fieldsIndexed = 0;
+    tableUsed = 0;
+    peerTableSize = encoderTableSize = 4096;
+    tableReset = false;
+
+    nextStreamId = 1;
+    pendingBlockStream = 0;
+    maxConcurrentStreams = HTTP2_MAX_STREAMS;
+    lastGoodStream = 0x7fffffff;
+    sendWindow = peerInitialWindow = HTTP2_DEFAULT_WINDOW;
+    gotSettings = goingAway = pendingBlockEnds = false;
+}
+
+QByteArray Http2Client::preface()
+{
+    QByteArray out("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+
+    //SETTINGS_HEADER_TABLE_SIZE 0 and SETTINGS_ENABLE_PUSH 0
+    QByteArray settings;
+    const quint16 ids[] = {1, 2};
+    for(quint16 id : ids)
+    {
+        settings.append((char)(id >> 8));
+        settings.append((char)id);
+        settings.append(4, (char)0);
+    }
+    appendFrame(out, SETTINGS, 0, 0, settings);
+    return out;
+}
+
+bool Http2Client::canOpenStream(int bodySize) const
+{
+    return ready() && streams.size() < maxStreams() && sendWindow >= bodySize && peerInitialWindow >= bodySize && nextStreamId < 0x7fffffff;
+}
+
+void Http2Client::appendFrame(QByteArray &out, quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload)
+{
+    quint32 length = payload.size();
+    out.append((char)(length >> 16));
+    out.append((char)(length >> 8));
+    out.append((char)length);
+    out.append((char)type);
+    out.append((char)flags);
+    out.append((char)((streamId >> 24) & 0x7f));
+    out.append((char)(streamId >> 16));
+    out.append((char)(streamId >> 8));
+    out.append((char)streamId);
+    out.append(payload);
+}
+
+void Http2Client::appendInt(QByteArray &out, quint32 value, int prefixBits, quint8 firstByte)
+{
+    quint32 max = (1u << prefixBits) - 1;
+    if(value < max)
+    {
+        out.append((char)(firstByte | value));
+        return;
+    }
+
+    out.append((char)(firstByte | max));
+    value -= max;
+    while(value >= 128)
+    {
+        out.append((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append((char)value);
+}
+
+bool Http2Client::readInt(const QByteArray &block, int &pos, int prefixBits, quint32 &value)
+{
+    if(pos >= block.size())
+        return false;
+
+    quint32 max = (1u << prefixBits) - 1;
+    value = (quint8)block[pos++] & max;
+    if(value < max)
+        return true;
+
+    for(int shift = 0; shift < 28; shift += 7)
+    {
+        if(pos >= block.size())
+            return false;
+        quint8 b = block[pos++];
+        value += (quint32)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool Http2Client::readString(const QByteArray &block, int &pos, QByteArray &value, bool &huffman)
+{
+    if(pos >= block.size())
+        return false;
+
+    quint32 length;
+    huffman = (quint8)block[pos] & 0x80;
+    if(!readInt(block, pos, 7, length) || length > (quint32)(block.size() - pos))
+        return false;
+
+    value = block.mid(pos, length);
+    pos += length;
+    return true;
+}
+
+bool Http2Client::huffmanDigits(const QByteArray &coded, QByteArray &digits)
+{
+    //Only the codes for 0-9 (RFC 7541 Appendix B), which is all a :status value has:
+    //0-2 are the 5 bit codes 00000-00010 and 3-9 are the 6 bit codes 011001-011111, the end's padded with 1s
+    quint32 bits = 0;
+    int have = 0, i = 0;
+    digits.clear();
+    for(;;)
+    {
+        while(have < 6 && i < coded.size())
+        {
+            bits = (bits << 8) | (quint8)coded[i++];
+            have += 8;
+        }
+        bits &= (1u << have) - 1;
+        if(have == 0)
+            return true;
+        if(i == coded.size() && have < 8 && bits == (1u << have) - 1)
+            return true;
+
+        if(have >= 5 && (bits >> (have - 5)) <= 2)
+        {
+            digits.append((char)('0' + (bits >> (have - 5))));
+            have -= 5;
+            continue;
+        }
+        quint32 code = (have >= 6) ? (bits >> (have - 6)) : 0;
+        if(code < 0x19 || code > 0x1f)
+            return false;
+        digits.append((char)('3' + code - 0x19));
+        have -= 6;
+    }
+}
+
+bool Http2Client::stripPadding(QByteArray &payload, quint8 flags)
+{
+    if(!(flags & PADDED))
+        return true;
+    if(payload.isEmpty())
+        return false;
+
+    int padding = (quint8)payload[0];
+    if(padding >= payload.size())
+        return false;
+    payload = payload.mid(1, payload.size() - 1 - padding);
+    return true;
+}
+
+void Http2Client::appendHeader(QByteArray &block, int field, quint32 staticName, int nameLength)
+{
+    //Already in the server's table it's a single byte, the newest entry is index 62
+    if(field < fieldsIndexed)
+    {
+        appendInt(block, 62 + (fieldsIndexed - 1 - field), 7, 0x80);
+        return;
+    }
+
+    const QByteArray &value = fieldValues[field];
+    quint32 size = nameLength + value.size() + 32;
+    if(field == fieldsIndexed && tableUsed + size <= encoderTableSize)
+    {
+        appendInt(block, staticName, 6, 0x40); //Literal with incremental indexing
+        tableUsed += size;
+        fieldsIndexed++;
+    }
+    else
+        appendInt(block, staticName, 4, 0x00); //Literal without indexing
+
+    appendInt(block, value.size(), 7, 0x00);
+    block.append(value);
+}
+
+quint32 Http2Client::request(const QByteArray &body, QByteArray &out)
+{
+    QByteArray block;
+    if(tableReset)
+    {
+        //Down to nothing first when what's in there wouldn't fit anymore, then everything's indexed again from scratch
+        if(tableUsed > peerTableSize)
+        {
+            appendInt(block, 0, 5, 0x20);
+            tableUsed = 0;
+            fieldsIndexed = 0;
+        }
+        appendInt(block, peerTableSize, 5, 0x20);
+        encoderTableSize = peerTableSize;
+        tableReset = false;
+    }
+
+    appendInt(block, 3, 7, 0x80); //:method POST
+    appendInt(block, 7, 7, 0x80); //:scheme https
+    appendHeader(block, AUTHORITY, 1, 10);
+    appendHeader(block, PATH, 4, 5);
+    appendHeader(block, ACCEPT, 19, 6);
+    appendHeader(block, CONTENT_TYPE, 31, 12);
+    appendHeader(block, USER_AGENT, 58, 10);
+    QByteArray length = QByteArray::number(body.size());
+    appendInt(block, 28, 4, 0x00); //content-length changes every time, it's never indexed
+    appendInt(block, length.size(), 7, 0x00);
+    block.append(length);
+
+    quint32 streamId = nextStreamId;
+    nextStreamId += 2;
+    appendFrame(out, HEADERS, END_HEADERS, streamId, block);
+    appendFrame(out, DATA, END_STREAM, streamId, body);
+    sendWindow -= body.size();
+
+    Stream stream;
+    stream.status = 0;
+    streams.insert(streamId, stream);
+    return streamId;
+}
+
+bool Http2Client::receive(const QByteArray &data, QByteArray &out, std::vector<Response> &done)
+{
+    received += data;
+    while(received.size() >= 9)
+    {
+        const uchar *header = (const uchar*)received.constData();
+        quint32 length = ((quint32)header[0] << 16) | ((quint32)header[1] << 8) | (quint32)header[2];
+        if(length > 16384) //We never raised SETTINGS_MAX_FRAME_SIZE
+            return false;
+        if((quint32)received.size() < 9 + length)
+            break;
+
+        quint8 type = header[3], flags = header[4];
+        quint32 streamId = readBigEndian32(received, 5) & 0x7fffffff;
+        QByteArray payload = received.mid(9, length);
+        received.remove(0, 9 + length);
+        if(!frame(type, flags, streamId, payload, out, done))
+            return false;
+    }
+    return true;
+}
+
+bool Http2Client::frame(quint8 type, quint8 flags, quint32 streamId, const QByteArray &framePayload, QByteArray &out, std::vector<Response> &done)
+{
+    QByteArray payload = framePayload;
+
+    //Nothing else can come between a header block's frames
+    if(pendingBlockStream != 0 && (type != CONTINUATION || streamId != pendingBlockStream))
+        return false;
+
+    switch(type)
+    {
+    case DATA:
+    {
+        if(!stripPadding(payload, flags))
+            return false;
+
+        //What it used of the connection's window (padding included) is given straight back, a stream's own window is only topped up if it goes on
+        if(framePayload.size() > 0)
+        {
+            QByteArray increment;
+            increment.append((char)0).append((char)(framePayload.size() >> 16)).append((char)(framePayload.size() >> 8)).append((char)framePayload.size());
+            appendFrame(out, WINDOW_UPDATE, 0, 0, increment);
+            if(!(flags & END_STREAM))
+                appendFrame(out, WINDOW_UPDATE, 0, streamId, increment);
+        }
+
+        auto stream = streams.find(streamId);
+        if(stream != streams.end())
+        {
+            stream->body.append(payload);
+            if(flags & END_STREAM)
+                finish(streamId, false, false, done);
+        }
+        return true;
+    }
+
+    case HEADERS:
+        if(!stripPadding(payload, flags))
+            return false;
+        if(flags & PRIORITY_FLAG)
+        {
+            if(payload.size() < 5)
+                return false;
+            payload.remove(0, 5);
+        }
+        if(flags & END_HEADERS)
+            return headerBlock(streamId, payload, flags & END_STREAM, done);
+
+        pendingBlock = payload;
+        pendingBlockStream = streamId;
+        pendingBlockEnds = flags & END_STREAM;
+        return true;
+
+    case CONTINUATION:
+    {
+        if(pendingBlockStream == 0)
+            return false;
+        pendingBlock.append(payload);
+        if(!(flags & END_HEADERS))
+            return true;
+
+        quint32 blockStream = pendingBlockStream;
+        pendingBlockStream = 0;
+        bool ok = headerBlock(blockStream, pendingBlock, pendingBlockEnds, done);
+        pendingBlock.clear();
+        return ok;
+    }
+
+    case RST_STREAM:
+        if(payload.size() != 4)
+            return false;
+        finish(streamId, true, readBigEndian32(payload) == 7, done); //REFUSED_STREAM: it was never looked at
+        return true;
+
+    case SETTINGS:
+        if(flags & ACK)
+            return true;
+        if(payload.size() % 6 != 0)
+            return false;
+
+        for(int i = 0; i < payload.size(); i += 6)
+        {
+            quint16 id = ((quint8)payload[i] << 8) | (quint8)payload[i + 1];
+            quint32 value = readBigEndian32(payload, i + 2);
+            if(id == 1) //SETTINGS_HEADER_TABLE_SIZE
+            {
+                peerTableSize = value;
+                if(value < encoderTableSize)
+                    tableReset = true;
+            }
+            else if(id == 3) //SETTINGS_MAX_CONCURRENT_STREAMS
+                maxConcurrentStreams = value;
+            else if(id == 4) //SETTINGS_INITIAL_WINDOW_SIZE
+            {
+                if(value > 0x7fffffff)
+                    return false;
+                peerInitialWindow = value;
+            }
+        }
+        gotSettings = true;
+        appendFrame(out, SETTINGS, ACK, 0, QByteArray());
+        return true;
+
+    case PING:
+        if(payload.size() != 8)
+            return false;
+        if(!(flags & ACK))
+            appendFrame(out, PING, ACK, 0, payload);
+        return true;
+
+    case GOAWAY:
+    {
+        if(payload.size() < 8)
+            return false;
+        lastGoodStream = readBigEndian32(payload) & 0x7fffffff;
+        goingAway = true;
+        qDebug() << "HTTP/2 GOAWAY, last stream:" << lastGoodStream << "error:" << readBigEndian32(payload, 4);
+
+        //Streams past the last one it processed can go again on a new connection
+        QList<quint32> ids = streams.keys();
+        for(quint32 id : ids)
+        {
+            if(id > lastGoodStream)
+                finish(id, true, true, done);
+        }
+        return true;
+    }
+
+    case WINDOW_UPDATE:
+        if(payload.size() != 4)
+            return false;
+        if(streamId == 0)
+            sendWindow += readBigEndian32(payload) & 0x7fffffff;
+        return true;
+
+    case PUSH_PROMISE:
+        return false; //Turned off in our SETTINGS
+
+    default:
+        return true; //PRIORITY and frame types we don't know are ignored
+    }
+}
+
+bool Http2Client::headerBlock(quint32 streamId, const QByteArray &block, bool endStream, std::vector<Response> &done)
+{
+    static const int staticStatuses[] = {200, 204, 206, 304, 400, 404, 500}; //Static table entries 8-14
+    int status = 0, pos = 0;
+    while(pos < block.size())
+    {
+        quint8 first = block[pos];
+        quint32 index;
+        if(first & 0x80) //Indexed
+        {
+            if(!readInt(block, pos, 7, index) || index == 0 || index > 61) //Our table is 0 bytes, nothing's ever in it
+                return false;
+            if(index >= 8 && index <= 14)
+                status = staticStatuses[index - 8];
+            continue;
+        }
+        if((first & 0xe0) == 0x20) //Table size update, can't be more than the 0 we allow
+        {
+            if(!readInt(block, pos, 5, index) || index != 0)
+                return false;
+            continue;
+        }
+
+        //Literal, with or without indexing (into our 0 byte table, so nothing's kept either way)
+        QByteArray name, value;
+        bool nameHuffman = false, valueHuffman = false;
+        if(!readInt(block, pos, (first & 0x40) ? 6 : 4, index) || index > 61)
+            return false;
+        if(index == 0 && !readString(block, pos, name, nameHuffman))
+            return false;
+        if(!readString(block, pos, value, valueHuffman))
+            return false;
+
+        if((index >= 8 && index <= 14) || (index == 0 && !nameHuffman && name == ":status"))
+        {
+            QByteArray digits = value;
+            if(valueHuffman && !huffmanDigits(value, digits))
+                return false;
+            status = digits.toInt();
+        }
+    }
+
+    //The first final status is the response's, anything after it is trailers
+    auto stream = streams.find(streamId);
+    if(stream != streams.end() && stream->status == 0 && status >= 200)
+        stream->status = status;
+    if(endStream)
+        finish(streamId, false, false, done);
+    return true;
+}
+
+void Http2Client::finish(quint32 streamId, bool failed, bool retry, std::vector<Response> &done)
+{
+    auto stream = streams.find(streamId);
+    if(stream == streams.end())
+        return;
+
+    Response response;
+    response.streamId = streamId;
+    response.status = stream->status;
+    response.body = stream->body;
+    response.failed = failed;
+    response.retry = retry;
+    streams.erase(stream);
+    done.push_back(response);
+}
@@ -0,0 +1,101 @@
+#ifndef HTTP2CLIENT_H
+#define HTTP2CLIENT_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QDebug>
+#include <vector>
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define HTTP2_MAX_STREAMS 100 //Our own cap when the server doesn't set SETTINGS_MAX_CONCURRENT_STREAMS
+#define HTTP2_DEFAULT_WINDOW 65535
+
+//Just enough HTTP/2 (RFC 7540) for DoH POSTs, the bytes in and out are the caller's to move over its TLS socket.
+//Every request is its own stream, so any number of them share the connection and answers come back in whatever order they're ready.
+//Request headers are HPACK compressed: the ones that never change (:authority, :path, accept, content-type, user-agent) go into the server's
+//dynamic table with the first request and every request after that refers to them by index.
+//We tell the server our own table is 0 bytes, so its response headers only ever use the static table and literals,
+//and reading :status never needs any state or a full Huffman decoder.
+class Http2Client
+{
+public:
+    struct Response
+    {
+        quint32 streamId;
+        int status;
+        QByteArray body;
+        bool failed, retry; //retry: the server never processed it (GOAWAY or REFUSED_STREAM), it's safe to send again
+    };
+
+    Http2Client(const QByteArray &authority, const QByteArray &path, const QByteArray &userAgent);
+    QByteArray preface();
+    bool ready() const { return gotSettings && !goingAway; }
+    bool canOpenStream(int bodySize) const;
+    int maxStreams() const { return (int)qMin(maxConcurrentStreams, (quint32)HTTP2_MAX_STREAMS); }
+    int openStreams() const { return streams.size(); }
+    bool isGoingAway() const { return goingAway; }
+    quint32 request(const QByteArray &body, QByteArray &out);
+    bool receive(const QByteArray &data, QByteArray &out, std::vector<Response> &done);
+
+private:
+    enum FrameType { DATA = 0, HEADERS = 1, PRIORITY = 2, RST_STREAM = 3, SETTINGS = 4, PUSH_PROMISE = 5, PING = 6, GOAWAY = 7, WINDOW_UPDATE = 8, CONTINUATION = 9 };
+    enum Flags { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+
+    struct Stream
+    {
+        int status;
+        QByteArray body;
+    };
+
+    static void appendFrame(QByteArray &out, quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload);
+    static void appendInt(QByteArray &out, quint32 value, int prefixBits, quint8 firstByte);
+    static bool readInt(const QByteArray &block, int &pos, int prefixBits, quint32 &value);
+    static bool readString(const QByteArray &block, int &pos, QByteArray &value, bool &huffman);
+    static bool huffmanDigits(const QByteArray &coded, QByteArray &digits);
+    static bool stripPadding(QByteArray &payload, quint8 flags);
+    void appendHeader(QByteArray &block, int field, quint32 staticName, int nameLength);
+    bool frame(quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload, QByteArray &out, std::vector<Response> &done);
+    bool headerBlock(quint32 streamId, const QByteArray &block, bool endStream, std::vector<Response> &done);
+    void finish(quint32 streamId, bool failed, bool retry, std::vector<Response> &done);
+
+    //The request headers the server keeps in its dynamic table for us, in the order they went in
+    enum IndexedField { AUTHORITY, PATH, ACCEPT, CONTENT_TYPE, USER_AGENT, INDEXED_FIELDS };
+    QByteArray fieldValues[INDEXED_FIELDS];
+    int fieldsIndexed;
+    quint32 tableUsed, peerTableSize, encoderTableSize;
+    bool tableReset; //The server lowered its table size, the next header block has to say so before using it
+
+    QHash<quint32, Stream> streams;
+    QByteArray received, pendingBlock;
+    quint32 nextStreamId, pendingBlockStream, maxConcurrentStreams, lastGoodStream;
+    qint64 sendWindow, peerInitialWindow;
+    bool gotSettings, goingAway, pendingBlockEnds;
+};
+
+#endif // HTTP2CLIENT_H
@@ -0,0 +1,255 @@
+#include "httpresponseparser.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+void HttpResponseParser::reset()
+{
+    state = STATUS_LINE;
+    status = 0;
+    body.clear();
+    closing = chunked = false;
+    contentLength = -1;
+    remaining = 0;
+}
+
+HttpResponseParser::Result HttpResponseParser::parse(const QByteArray &buffer, int &pos)
+{
+    while(state != DONE)
+    {
+        if(state == BODY || state == CHUNK_DATA)
+        {
+            int available = (int)qMin((qint64)(buffer.size() - pos), remaining);
+            if(available == 0)
+                return NEED_MORE;
+            if(body.isEmpty() && available == remaining)
+                body = buffer.mid(pos, available); //The usual case, the whole body is already here
+            else
+                body.append(buffer.constData() + pos, available);
+            pos += available;
+            remaining -= available;
+            if(remaining == 0)
+                state = (state == BODY) ? DONE : CHUNK_DATA_END;
+            continue;
+        }
+        if(state == UNTIL_CLOSE)
+        {
+            body.append(buffer.constData() + pos, buffer.size() - pos);
+            pos = buffer.size();
+            return (body.size() > HTTP_MAX_BODY) ? MALFORMED : NEED_MORE;
+        }
+
+        //Everything else is a line at a time
+        int end = buffer.indexOf('\n', pos);
+        if(end == -1)
+            return (buffer.size() - pos > HTTP_MAX_LINE) ? MALFORMED : NEED_MORE;
+
+        const char *line = buffer.constData() + pos;
+        int length = end - pos;
+        if(length > 0 && line[length - 1] == '\r')
+            length--;
+        pos = end + 1;
+        if(length > HTTP_MAX_LINE || !parseLine(line, length))
+            return MALFORMED;
+    }
+    return COMPLETE;
+}
+
+bool HttpResponseParser::finishAtClose(const QByteArray &buffer, int &pos)
+{
+    if(state != UNTIL_CLOSE)
+        return false;
+    body.append(buffer.constData() + pos, buffer.size() - pos);
+    pos = buffer.size();
+    state = DONE;
+    return body.size() <= HTTP_MAX_BODY;
+}
+
+bool HttpResponseParser::parseLine(const char *line, int length)
+{
+    switch(state)
+    {
+    case STATUS_LINE:
+    {
+        if(length == 0)
+            return true; //Stray blank lines between responses are allowed
+        //HTTP/1.x 200 Reason
+        if(length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+            return false;
+        status = 0;
+        for(int i = 9; i < 12; i++)
+        {
+            if(line[i] < '0' || line[i] > '9')
+                return false;
+            status = status * 10 + (line[i] - '0');
+        }
+        closing = (line[7] == '0'); //HTTP/1.0 closes unless it says keep-alive
+        state = HEADER;
+        return true;
+    }
+
+    case HEADER:
+    {
+        if(length == 0)
+            return headersDone();
+
+        const char *colon = (const char*)memchr(line, ':', length);
+        if(colon == nullptr)
+            return false;
+        int nameLength = colon - line;
+        const char *value = colon + 1;
+        int valueLength = length - nameLength - 1;
+        while(valueLength > 0 && (*value == ' ' || *value == '\t'))
+        {
+            value++;
+            valueLength--;
+        }
+        while(valueLength > 0 && (value[valueLength - 1] == ' ' || value[valueLength - 1] == '\t'))
+            valueLength--;
+
+        if(headerIs(line, nameLength, "content-length"))
+        {
+            if(valueLength == 0)
+                return false;
+            qint64 parsedLength = 0;
+            for(int i = 0; i < valueLength; i++)
+            {
+                if(value[i] < '0' || value[i] > '9')
+                    return false;
+                parsedLength = parsedLength * 10 + (value[i] - '0');
+                if(parsedLength > HTTP_MAX_BODY)
+                    return false;
+            }
+            if(contentLength != -1 && contentLength != parsedLength)
+                return false; //Two different lengths, there's no telling where it ends
+            contentLength = parsedLength;
+        }
+        else if(headerIs(line, nameLength, "transfer-encoding"))
+            chunked = valueContains(value, valueLength, "chunked");
+        else if(headerIs(line, nameLength, "connection"))
+        {
+            if(valueContains(value, valueLength, "close"))
+                closing = true;
+            else if(valueContains(value, valueLength, "keep-alive"))
+                closing = false;
+        }
+        return true;
+    }
+
+    case CHUNK_SIZE:
+    {
+        //Hex size, optionally followed by ;extensions
+        qint64 size = 0;
+        int digits = 0;
+        for(; digits < length && line[digits] != ';' && line[digits] != ' ' && line[digits] != '\t'; digits++)
+        {
+            char c = line[digits];
+            int value;
+            if(c >= '0' && c <= '9')
+                value = c - '0';
+            else if(c >= 'a' && c <= 'f')
+                value = c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F')
+                value = c - 'A' + 10;
+            else
+                return false;
+            size = size * 16 + value;
+            if(body.size() + size > HTTP_MAX_BODY)
+                return false;
+        }
+        if(digits == 0)
+            return false;
+        if(size == 0)
+            state = TRAILER;
+        else
+        {
+            remaining = size;
+            state = CHUNK_DATA;
+        }
+        return true;
+    }
+
+    case CHUNK_DATA_END:
+        if(length != 0)
+            return false;
+        state = CHUNK_SIZE;
+        return true;
+
+    case TRAILER:
+        if(length == 0)
+            state = DONE; //Trailer fields themselves aren't anything we need
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool HttpResponseParser::headersDone()
+{
+    if(status >= 100 && status < 200)
+    {
+        //Interim response (100 Continue and the like), the real one follows
+        reset();
+        return true;
+    }
+
+    if(status == 204 || status == 304)
+        state = DONE;
+    else if(chunked)
+        state = CHUNK_SIZE; //Takes precedence over any Content-Length
+    else if(contentLength == 0)
+        state = DONE;
+    else if(contentLength > 0)
+    {
+        remaining = contentLength;
+        state = BODY;
+    }
+    else if(closing)
+        state = UNTIL_CLOSE;
+    else
+        return false; //Nothing says where the body ends on a connection that stays open
+    return true;
+}
+
+bool HttpResponseParser::headerIs(const char *name, int nameLength, const char *expected)
+{
+    while(nameLength > 0 && (name[nameLength - 1] == ' ' || name[nameLength - 1] == '\t'))
+        nameLength--;
+    return nameLength == (int)qstrlen(expected) && qstrnicmp(name, expected, nameLength) == 0;
+}
+
+bool HttpResponseParser::valueContains(const char *value, int valueLength, const char *token)
+{
+    int tokenLength = qstrlen(token);
+    for(int i = 0; i + tokenLength <= valueLength; i++)
+    {
+        if(qstrnicmp(value + i, token, tokenLength) == 0)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,66 @@
+#ifndef HTTPRESPONSEPARSER_H
+#define HTTPRESPONSEPARSER_H
+
+#include <QByteArray>
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define HTTP_MAX_LINE 8192 //Status line, header line or chunk size line
+#define HTTP_MAX_BODY 65535 //Nothing bigger can be a DNS message
+
+//Incremental HTTP/1.1 response parser for keep-alive connections: feed it the receive buffer as more arrives and it picks up where it left off,
+//it never rescans a line it's already been through. Bodies framed by Content-Length, chunked transfer-encoding, or (with Connection: close)
+//the end of the connection are all understood, and whatever's after one complete response is left in the buffer for the next one.
+class HttpResponseParser
+{
+public:
+    enum Result { NEED_MORE, COMPLETE, MALFORMED };
+    HttpResponseParser() { reset(); }
+    void reset();
+    //Parses from pos on, pos is left after everything that's been consumed
+    Result parse(const QByteArray &buffer, int &pos);
+    //The connection closed, true if that's what ends the current response's body
+    bool finishAtClose(const QByteArray &buffer, int &pos);
+
+    int status;
+    QByteArray body;
+    bool closing; //The server will close the connection after this response
+
+private:
+    enum State { STATUS_LINE, HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, TRAILER, UNTIL_CLOSE, DONE };
+    bool parseLine(const char *line, int length);
+    bool headersDone();
+    static bool headerIs(const char *name, int nameLength, const char *expected);
+    static bool valueContains(const char *value, int valueLength, const char *token);
+
+    State state;
+    qint64 contentLength, remaining;
+    bool chunked;
+};
+
+#endif // HTTPRESPONSEPARSER_H
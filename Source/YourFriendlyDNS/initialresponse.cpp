@@ -120,54 +120,3 @@ void morphRequestIntoARecordResponse(QByteArray &dnsrequest, std::vector<quint32
         }
     }
 }
-
-InitialResponse::InitialResponse(DNSInfo &dns, QObject *parent)
-{
-    Q_UNUSED(parent);
-    respondTo.question.qtype = dns.question.qtype;
-    respondTo.domainString = dns.domainString;
-    respondTo.sender = dns.sender;
-    respondTo.senderPort = dns.senderPort;
-    respondTo.req = dns.req;
-    respondTo.ttl = dns.ttl;
-    timeWithoutAResponse = QDateTime::currentDateTime();
-    responseHandled = false;
-}
-
-void InitialResponse::lookupDoneSendResponseNow(DNSInfo &dns, QUdpSocket *serversocket)
-{
-    if(respondTo == dns && !responseHandled)
-    {
-        if(respondTo.req.size() > DNS_HEADER_SIZE)
-        {
-            if(dns.question.qtype == DNS_TYPE_A)
-            {
-                if(dns.hasIPs)
-                {
-                    morphRequestIntoARecordResponse(respondTo.req, dns.ipaddresses, dns.answeroffset, respondTo.ttl);
-                    serversocket->writeDatagram(respondTo.req, respondTo.sender, respondTo.senderPort);
-                    qDebug() << "[A RECORD] to:" << respondTo.sender << respondTo.senderPort << "\n" << respondTo.req;
-                }
-            }
-            else
-            {
-                if(dns.res.size() > DNS_HEADER_SIZE)
-                {
-                    *(quint16*)dns.res.data() = *(quint16*)respondTo.req.data(); //match the request/response ids in case they aren't matching
-                    serversocket->writeDatagram(dns.res, respondTo.sender, respondTo.senderPort);
-                    qDebug() << "Responding to a type:" << dns.question.qtype << "\n" << dns.res;
-                }
-            }
-        }
-
-        qDebug() << "Response handled in:" << ((float)timeWithoutAResponse.msecsTo(QDateTime::currentDateTime()) / 1000.0f) << "secs";
-        responseHandled = true;
-        this->deleteLater();
-    }
-}
-
-void InitialResponse::deleteObjectsTheresNoResponseFor()
-{
-    if(!responseHandled && timeWithoutAResponse.secsTo(QDateTime::currentDateTime()) > 60)
-        this->deleteLater();
-}
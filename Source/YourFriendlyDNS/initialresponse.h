@@ -37,25 +37,4 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 void morphRequestIntoARecordResponse(QByteArray &dnsrequest, quint32 responseIP, quint32 spliceOffset, quint32 ttl = 13337);
 void morphRequestIntoARecordResponse(QByteArray &dnsrequest, std::vector<quint32> &responseIPs, quint32 spliceOffset, quint32 ttl = 13337);
 
-class InitialResponse : public QObject
-{
-public:
-    Q_OBJECT
-public:
-    explicit InitialResponse(DNSInfo &dns, QObject *parent=0);
-
-private:
-    //QUdpSocket sock;
-    QDateTime timeWithoutAResponse;
-    DNSInfo respondTo;
-    bool responseHandled;
-
-signals:
-    void finished();
-
-public slots:
-    void lookupDoneSendResponseNow(DNSInfo &dns, QUdpSocket *serversocket);
-    void deleteObjectsTheresNoResponseFor();
-};
-
 #endif // INITIALRESPONSE_H
@@ -0,0 +1,207 @@
+#include "keypairpool.h"
+#include "dnscrypt.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+static QAtomicInteger<quint64> generatedKeypairs, precomputedKeys, takenKeypairs, emptyPoolFallbacks, generateNsecs;
+
+KeypairPool::KeypairPool()
+{
+    head.store(0);
+    tail.store(0);
+    esVersion = consumerESVersion = 0;
+    haveServerKey = consumerHasServerKey = false;
+    KeypairRefiller::instance()->addPool(this);
+}
+
+KeypairPool::~KeypairPool()
+{
+    KeypairRefiller::instance()->removePool(this);
+    sodium_memzero(ring, sizeof ring);
+}
+
+bool KeypairPool::take(PooledKeypair &keypair)
+{
+    //Consumer side
+    quint32 t = tail.load();
+    if(t == head.loadAcquire())
+    {
+        emptyPoolFallbacks.fetchAndAddRelaxed(1);
+        KeypairRefiller::instance()->wake();
+        return false;
+    }
+
+    PooledKeypair &pooled = ring[t % KEYPAIR_POOL_SIZE];
+    keypair = pooled;
+    sodium_memzero(pooled.sk, sizeof pooled.sk);
+    sodium_memzero(pooled.sharedKey, sizeof pooled.sharedKey);
+    tail.storeRelease(t + 1);
+    takenKeypairs.fetchAndAddRelaxed(1);
+
+    if(depth() < KEYPAIR_POOL_LOW_WATERMARK)
+        KeypairRefiller::instance()->wake();
+    return true;
+}
+
+void KeypairPool::setServerKey(const quint8 *serverKey, quint32 es)
+{
+    //Compared against the consumer's own copy first, so the lock's only taken when the certificate actually changed
+    if(consumerHasServerKey && consumerESVersion == es && memcmp(consumerServerPK, serverKey, crypto_box_PUBLICKEYBYTES) == 0)
+        return;
+
+    memcpy(consumerServerPK, serverKey, crypto_box_PUBLICKEYBYTES);
+    consumerESVersion = es;
+    consumerHasServerKey = true;
+
+    QMutexLocker locker(&serverKeyLock);
+    memcpy(serverPK, serverKey, crypto_box_PUBLICKEYBYTES);
+    esVersion = es;
+    haveServerKey = true;
+}
+
+int KeypairPool::fill()
+{
+    //Producer side, only ever run on the refill thread
+    quint8 target[crypto_box_PUBLICKEYBYTES];
+    quint32 targetES = 0;
+    bool precompute;
+    serverKeyLock.lock();
+    precompute = haveServerKey;
+    if(precompute)
+    {
+        memcpy(target, serverPK, sizeof target);
+        targetES = esVersion;
+    }
+    serverKeyLock.unlock();
+
+    int made = 0;
+    quint32 h = head.load();
+    while(h - tail.loadAcquire() < KEYPAIR_POOL_SIZE)
+    {
+        PooledKeypair &k = ring[h % KEYPAIR_POOL_SIZE];
+        crypto_box_keypair(k.pk, k.sk);
+        k.hasSharedKey = precompute && DNSCrypt::beforenm(k.sharedKey, target, k.sk, targetES) == 0;
+        if(k.hasSharedKey)
+        {
+            memcpy(k.serverPK, target, sizeof target);
+            k.esVersion = targetES;
+            precomputedKeys.fetchAndAddRelaxed(1);
+        }
+        head.storeRelease(++h);
+        made++;
+    }
+    return made;
+}
+
+KeypairPoolStats KeypairPool::stats()
+{
+    KeypairPoolStats stats;
+    KeypairRefiller::instance()->poolStats(stats);
+    stats.generated = generatedKeypairs.loadAcquire();
+    stats.precomputed = precomputedKeys.loadAcquire();
+    stats.taken = takenKeypairs.loadAcquire();
+    stats.emptyFallbacks = emptyPoolFallbacks.loadAcquire();
+    stats.generateNsecs = generateNsecs.loadAcquire();
+    return stats;
+}
+
+KeypairRefiller::KeypairRefiller()
+{
+    stopping = false;
+}
+
+KeypairRefiller::~KeypairRefiller()
+{
+    lock.lock();
+    stopping = true;
+    wanted.wakeAll();
+    lock.unlock();
+    wait();
+}
+
+KeypairRefiller *KeypairRefiller::instance()
+{
+    static KeypairRefiller refiller;
+    return &refiller;
+}
+
+void KeypairRefiller::addPool(KeypairPool *pool)
+{
+    QMutexLocker locker(&lock);
+    pools.append(pool);
+    wanted.wakeAll();
+    if(!isRunning())
+        start(QThread::LowPriority);
+}
+
+void KeypairRefiller::removePool(KeypairPool *pool)
+{
+    //Blocks while a fill is underway, so the pool's never written to after this
+    QMutexLocker locker(&lock);
+    pools.removeAll(pool);
+}
+
+void KeypairRefiller::wake()
+{
+    //Called on the event loop, so it never waits for the lock: if it's held the refill thread is busy filling and goes round again after
+    if(lock.tryLock())
+    {
+        wanted.wakeAll();
+        lock.unlock();
+    }
+}
+
+void KeypairRefiller::poolStats(KeypairPoolStats &stats)
+{
+    QMutexLocker locker(&lock);
+    stats.pools = pools.size();
+    for(KeypairPool *pool : pools)
+        stats.depth += pool->depth();
+    stats.capacity = stats.pools * KEYPAIR_POOL_SIZE;
+}
+
+void KeypairRefiller::run()
+{
+    QMutexLocker locker(&lock);
+    while(!stopping)
+    {
+        int made = 0;
+        QElapsedTimer timer;
+        timer.start();
+        for(KeypairPool *pool : pools)
+            made += pool->fill();
+
+        if(made > 0)
+        {
+            generatedKeypairs.fetchAndAddRelaxed(made);
+            generateNsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+            continue; //Something was taken while filling maybe, check again before sleeping
+        }
+        wanted.wait(&lock, KEYPAIR_REFILL_INTERVAL_MS);
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef KEYPAIRPOOL_H
+#define KEYPAIRPOOL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInteger>
+#include <QVector>
+#include <sodium.h>
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define KEYPAIR_POOL_SIZE 64 //Per certificate, power of two
+#define KEYPAIR_POOL_LOW_WATERMARK 16
+#define KEYPAIR_REFILL_INTERVAL_MS 1000
+
+class KeypairPoolStats
+{
+public:
+    KeypairPoolStats() { pools = depth = capacity = generated = precomputed = taken = emptyFallbacks = generateNsecs = 0; }
+    double keygenRate() const { return generateNsecs ? (double)generated * 1000000000.0 / (double)generateNsecs : 0.0; }
+
+    quint64 pools, depth, capacity; //Right now, over every pool
+    quint64 generated, precomputed, taken, emptyFallbacks, generateNsecs; //Since startup, emptyFallbacks are keypairs made on the spot
+};
+
+struct PooledKeypair
+{
+    quint8 pk[crypto_box_PUBLICKEYBYTES];
+    quint8 sk[crypto_box_SECRETKEYBYTES];
+    quint8 sharedKey[crypto_box_BEFORENMBYTES]; //Only when hasSharedKey, and only good with serverPK/esVersion
+    quint8 serverPK[crypto_box_PUBLICKEYBYTES];
+    quint32 esVersion;
+    bool hasSharedKey;
+};
+
+//Ephemeral keypairs made ahead of time for newKeyPerRequest, so a query takes one instead of running crypto_box_keypair on the event loop.
+//One producer (the shared refill thread) and one consumer (the thread the certificate's holder lives in), lock free between the two:
+//the producer only ever moves head and the consumer only ever moves tail.
+//Once the consumer says which server key it's using, the refill thread precomputes each new keypair's shared key with it too,
+//keypairs made for an older server key still work, the consumer just derives their shared key itself.
+class KeypairPool
+{
+public:
+    KeypairPool();
+    ~KeypairPool();
+    bool take(PooledKeypair &keypair);
+    void setServerKey(const quint8 *serverPK, quint32 esVersion);
+    quint32 depth() const { return head.loadAcquire() - tail.loadAcquire(); }
+    static KeypairPoolStats stats();
+
+private:
+    friend class KeypairRefiller;
+    int fill();
+
+    PooledKeypair ring[KEYPAIR_POOL_SIZE];
+    QAtomicInteger<quint32> head, tail;
+
+    QMutex serverKeyLock; //Only taken when the server key changes, and by the refill thread once per fill
+    quint8 serverPK[crypto_box_PUBLICKEYBYTES], consumerServerPK[crypto_box_PUBLICKEYBYTES];
+    quint32 esVersion, consumerESVersion;
+    bool haveServerKey, consumerHasServerKey;
+};
+
+//The one thread keeping every pool topped up, it sleeps whenever they're all full
+class KeypairRefiller : public QThread
+{
+public:
+    static KeypairRefiller* instance();
+    ~KeypairRefiller();
+    void addPool(KeypairPool *pool);
+    void removePool(KeypairPool *pool);
+    void wake();
+    void poolStats(KeypairPoolStats &stats);
+
+protected:
+    void run();
+
+private:
+    KeypairRefiller();
+    QMutex lock;
+    QWaitCondition wanted;
+    QVector<KeypairPool*> pools;
+    bool stopping;
+};
+
+#endif // KEYPAIRPOOL_H
@@ -0,0 +1,165 @@
+#include "listmatcher.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+ListMatcher::ListMatcher()
+{
+    nodes.push_back(Node());
+}
+
+ListMatcher::ListMatcher(const QVector<ListEntry> &list)
+{
+    entries = list;
+    nodes.push_back(Node());
+    for(int i = 0; i < entries.size(); i++)
+        addRule(entries[i].hostname, i);
+
+    qDebug() << "Compiled list of" << entries.size() << "entries into" << nodes.size() << "trie nodes," << fallbackRules.size() << "wildcard fallbacks";
+}
+
+void ListMatcher::keepFirst(int &rule, int index)
+{
+    if(index != -1 && (rule == -1 || index < rule))
+        rule = index;
+}
+
+int ListMatcher::nodeFor(const QList<QByteArray> &labels, int first)
+{
+    //Walks (and creates where needed) the path for labels[first..] starting from the rightmost one
+    int node = 0;
+    for(int i = labels.size() - 1; i >= first; i--)
+    {
+        auto child = nodes[node].children.constFind(labels[i]);
+        if(child != nodes[node].children.constEnd())
+        {
+            node = child.value();
+            continue;
+        }
+
+        int newNode = (int)nodes.size();
+        nodes[node].children.insert(labels[i], newNode);
+        nodes.push_back(Node());
+        node = newNode;
+    }
+    return node;
+}
+
+void ListMatcher::addRule(const QString &pattern, int index)
+{
+    QByteArray wild = pattern.trimmed().toLower().toUtf8();
+    if(wild.isEmpty()) return;
+
+    int stars = wild.count('*');
+    if(stars == 0)
+    {
+        QList<QByteArray> labels = wild.split('.');
+        if(!labels.contains(QByteArray()))
+        {
+            keepFirst(nodes[nodeFor(labels, 0)].exactRule, index);
+            return;
+        }
+    }
+    else if(stars == 1 && wild.startsWith('*') && wild.size() > 1)
+    {
+        //"*github.com" -> partial label "github" hanging off the com node, "*.github.com" -> any label under github.com
+        QList<QByteArray> parts = wild.mid(1).split('.');
+        bool emptyLabel = false;
+        for(int i = 1; i < parts.size(); i++)
+            emptyLabel |= parts[i].isEmpty();
+
+        if(!emptyLabel)
+        {
+            int node = nodeFor(parts, 1);
+            const QByteArray &partial = parts[0];
+            if(partial.isEmpty())
+                keepFirst(nodes[node].anyLabelRule, index);
+            else
+            {
+                int rule = nodes[node].partialRules.value(partial, -1);
+                keepFirst(rule, index);
+                nodes[node].partialRules.insert(partial, rule);
+                nodes[node].maxPartialLen = qMax(nodes[node].maxPartialLen, partial.size());
+            }
+            return;
+        }
+    }
+
+    fallbackRules.append(index);
+    fallbackPatterns.append(wild);
+}
+
+const ListEntry* ListMatcher::match(const QString &domain) const
+{
+    QByteArray tame = domain.toLower().toUtf8();
+    const char *name = tame.constData();
+    int best = -1, node = 0, end = tame.size();
+
+    //Walk right to left one label at a time, name[0..end) is the part that hasn't been matched against the trie yet
+    for(;;)
+    {
+        const Node &n = nodes[node];
+        if(end < 0)
+        {
+            keepFirst(best, n.exactRule);
+            break;
+        }
+
+        int labelStart = end;
+        while(labelStart > 0 && name[labelStart - 1] != '.')
+            labelStart--;
+        int labelLen = end - labelStart;
+
+        if(labelLen > 0)
+        {
+            keepFirst(best, n.anyLabelRule);
+            for(int len = 1; len <= labelLen && len <= n.maxPartialLen; len++)
+                keepFirst(best, n.partialRules.value(QByteArray::fromRawData(name + end - len, len), -1));
+        }
+
+        auto child = n.children.constFind(QByteArray::fromRawData(name + labelStart, labelLen));
+        if(child == n.children.constEnd())
+            break;
+
+        node = child.value();
+        end = labelStart - 1; //Skips the dot, or goes to -1 when every label has been consumed
+    }
+
+    //Only the unusual patterns are left, and only the ones that come before what's already matched could change the result
+    for(int i = 0; i < fallbackRules.size(); i++)
+    {
+        if(best != -1 && fallbackRules[i] > best)
+            break;
+        if(GeneralTextCompare((char*)tame.constData(), (char*)fallbackPatterns[i].constData()))
+        {
+            best = fallbackRules[i];
+            break;
+        }
+    }
+
+    return (best == -1) ? nullptr : &entries.at(best);
+}
@@ -0,0 +1,83 @@
+#ifndef LISTMATCHER_H
+#define LISTMATCHER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QDebug>
+#include <vector>
+#include "dnsinfo.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+/* GeneralTextCompare By Kirk J. Krauss, August 26, 2008
+
+A simple wildcard text-matching algorithm in a single while loop */
+bool GeneralTextCompare(
+        char * pTameText,             // A string without wildcards
+        char * pWildText,             // A (potentially) corresponding string with wildcards
+        bool bCaseSensitive = false,  // By default, match on 'X' vs 'x'
+        char cAltTerminator = '\0'    // For function names, for example, you can stop at the first '('
+);
+
+//A whitelist/blacklist compiled into a trie of reversed labels (com -> github -> www), built once whenever the list changes.
+//Exact hostnames and the common "*suffix" wildcards are resolved by walking the queried name's labels once,
+//so a lookup costs the same with 10 entries or 200k. Any other wildcard pattern ("ads*.example.com", "*tracker*")
+//goes to a small fallback list that's still matched with GeneralTextCompare.
+//When several entries match, the one that comes first in the list wins, exactly like the old linear scan.
+class ListMatcher
+{
+public:
+    ListMatcher();
+    explicit ListMatcher(const QVector<ListEntry> &list);
+    const ListEntry* match(const QString &domain) const;
+    int size() const { return entries.size(); }
+
+private:
+    struct Node
+    {
+        Node() { exactRule = anyLabelRule = -1; maxPartialLen = 0; }
+        QHash<QByteArray, int> children;
+        int exactRule;    //"github.com"
+        int anyLabelRule; //"*.github.com" -> at least one more label to the left
+        QHash<QByteArray, int> partialRules; //"*github.com" at the "com" node -> the next label to the left ends with "github"
+        int maxPartialLen;
+    };
+
+    void addRule(const QString &pattern, int index);
+    int nodeFor(const QList<QByteArray> &labels, int first);
+    static void keepFirst(int &rule, int index);
+
+    QVector<ListEntry> entries;
+    std::vector<Node> nodes;
+    QVector<int> fallbackRules;
+    QVector<QByteArray> fallbackPatterns;
+};
+
+#endif // LISTMATCHER_H
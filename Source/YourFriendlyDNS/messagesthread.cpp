@@ -35,6 +35,8 @@ AppData::AppData()
     httpServer = nullptr;
     dnsServerPort = 53;
     httpServerPort = 80;
+    dnsWorkerThreads = 1;
+    cryptoWorkerThreads = 0;
 }
 
 AppData* AppData::get()
@@ -50,6 +52,21 @@ void MessagesThread::run()
     data->dnsServer = new SmallDNSServer();
     data->httpServer = new SmallHTTPServer();
 
+    //Pick up where the last run left off instead of sending everything upstream again. That waits for the first settings published after the UI's
+    //loaded them, so the memory budget and stale window the entries are kept under are the user's and not the defaults.
+    //Until then nothing's saved either, it would only overwrite the snapshot with an empty cache
+    QString snapshotPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QDir::separator() + "YourFriendlyDNS.cache";
+    bool snapshotLoaded = false;
+    QTimer snapshotTimer;
+    connect(&snapshotTimer, &QTimer::timeout, [this, snapshotPath]() { data->dnsServer->dnsCache->saveSnapshot(snapshotPath); });
+    QMetaObject::Connection loadSnapshot;
+    loadSnapshot = connect(data->dnsServer, &SmallDNSServer::settingsPublished, data->dnsServer, [&](ServerSettingsSnapshot settings) {
+        disconnect(loadSnapshot);
+        data->dnsServer->dnsCache->loadSnapshot(snapshotPath, settings->serveStale ? settings->staleMaxAge : 0);
+        snapshotLoaded = true;
+        snapshotTimer.start(CACHE_SNAPSHOT_INTERVAL_MS);
+    });
+
     emit serversInitialized();
 
     #ifdef Q_OS_ANDROID
@@ -64,20 +81,90 @@ void MessagesThread::run()
     emit androidInit();
     #endif
 
-    if(data->dnsServer->startServer(QHostAddress::Any, data->dnsServerPort))
+    bool reusePort = (data->dnsWorkerThreads > 1 && SmallDNSServer::reusePortBalancesLoad());
+    if(data->dnsWorkerThreads > 1 && !reusePort)
+        qDebug() << "This platform can't spread queries over several sockets on one port, using a single DNS thread";
+
+    if(data->dnsServer->startServer(QHostAddress::Any, data->dnsServerPort, false, reusePort))
+    {
         qDebug() << "DNS server started on address:" << data->dnsServer->serversock.localAddress() << "and port:" << data->dnsServer->serversock.localPort();
+        if(reusePort)
+        {
+            for(quint32 i = 1; i < data->dnsWorkerThreads; i++)
+            {
+                DNSWorker *worker = new DNSWorker(data->dnsServer, data->dnsServer->publishedSettings(), data->dnsServerPort);
+                connect(data->dnsServer, &SmallDNSServer::settingsPublished, worker, &DNSWorker::settingsPublished);
+                dnsWorkers.append(worker);
+                worker->start();
+            }
+        }
+    }
     if(data->httpServer->startServer(QHostAddress::Any, data->httpServerPort))
         qDebug() << "HTTP server started on address:" << data->httpServer->serverAddress() << "and port:" << data->httpServer->serverPort();
 
     qDebug() << "MessagesThread started, for handling server duties!";
     exec(); //handles the signals and slots for objects owned by this thread
+
+    disconnect(loadSnapshot);
+    snapshotTimer.stop();
+    if(snapshotLoaded)
+        data->dnsServer->dnsCache->saveSnapshot(snapshotPath);
 }
 
 MessagesThread::~MessagesThread()
 {
+    //Workers share the primary server's cache, so they have to be gone before it is
+    for(DNSWorker *worker : dnsWorkers)
+    {
+        worker->quit();
+        worker->wait();
+        delete worker;
+    }
+    dnsWorkers.clear();
+
     data = AppData::get();
     if(data->httpServer)
         delete data->httpServer;
     if(data->dnsServer)
         delete data->dnsServer;
 }
+
+DNSWorker::DNSWorker(SmallDNSServer *primaryServer, ServerSettingsSnapshot settings, quint16 listenPort)
+{
+    primary = primaryServer;
+    latestSettings = settings;
+    port = listenPort;
+}
+
+void DNSWorker::settingsPublished(ServerSettingsSnapshot settings)
+{
+    //Held while it's handed on, so run() either sees this one as the latest or is already connected when it goes out
+    QMutexLocker locker(&settingsLock);
+    latestSettings = settings;
+    emit adoptSettings(settings);
+}
+
+void DNSWorker::run()
+{
+    //Created here so it belongs to (and its sockets are serviced by) this thread
+    SmallDNSServer *server = new SmallDNSServer(primary->dnsCache);
+
+    connect(server, &SmallDNSServer::queryRespondedTo, primary, &SmallDNSServer::queryRespondedTo);
+    connect(server->dnscrypt, &DNSCrypt::displayLastUsedProvider, primary->dnscrypt, &DNSCrypt::displayLastUsedProvider);
+
+    //Anything published from now on is queued to the server, this takes what was already there before the socket starts reading
+    settingsLock.lock();
+    connect(this, &DNSWorker::adoptSettings, server, &SmallDNSServer::adoptSettings);
+    ServerSettingsSnapshot settings = latestSettings;
+    settingsLock.unlock();
+    if(settings)
+        server->adoptSettings(settings);
+
+    if(server->startServer(QHostAddress::Any, port, false, true))
+    {
+        qDebug() << "DNS worker thread started on port:" << server->serversock.localPort();
+        exec();
+    }
+
+    delete server;
+}
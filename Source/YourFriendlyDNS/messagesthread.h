@@ -2,6 +2,7 @@
 #define MESSAGESTHREAD_H
 
 #include <QThread>
+#include <QMutex>
 #include <QProcess>
 #include "smalldnsserver.h"
 #include "smallhttpserver.h"
@@ -40,17 +41,43 @@ public:
     SmallDNSServer *dnsServer;
     SmallHTTPServer *httpServer;
     quint16 dnsServerPort, httpServerPort;
+    quint32 dnsWorkerThreads, cryptoWorkerThreads; //0 crypto workers: DNSCrypt seals and opens on the server threads themselves
 
     AppData();
     static AppData* get();
 };
 
+//An extra thread answering DNS on the same port as the primary server (each has its own SO_REUSEPORT socket and the kernel spreads queries over them),
+//running the whole parse/list/cache path on its own core. Settings come from the primary server and the cache is the primary's shared one.
+//The primary's published settings pass through here (this object lives on the primary's thread) on their way to the worker's own server,
+//which never reads the primary server itself.
+class DNSWorker : public QThread
+{
+    Q_OBJECT
+public:
+    DNSWorker(SmallDNSServer *primaryServer, ServerSettingsSnapshot settings, quint16 listenPort);
+    void run();
+
+public slots:
+    void settingsPublished(ServerSettingsSnapshot settings);
+
+signals:
+    void adoptSettings(ServerSettingsSnapshot settings);
+
+private:
+    SmallDNSServer *primary; //Only for connecting signals
+    QMutex settingsLock;
+    ServerSettingsSnapshot latestSettings;
+    quint16 port;
+};
+
 class MessagesThread : public QThread
 {
     Q_OBJECT
 public:
     ~MessagesThread();
     AppData *data;
+    QVector<DNSWorker*> dnsWorkers;
     void run();
 
 signals:
@@ -0,0 +1,189 @@
+#include "pendingqueries.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+PendingQueries::PendingQueries()
+{
+    nextSerial = 0;
+}
+
+PendingQueries::State PendingQueries::state(const QByteArray &question) const
+{
+    auto lookup = byQuestion.constFind(question);
+    if(lookup == byQuestion.constEnd())
+        return NOT_IN_FLIGHT;
+
+    auto e = inFlight.constFind(lookup.value());
+    if(e->staleAt != 0 && e->staleAt <= QDateTime::currentMSecsSinceEpoch())
+        return IN_FLIGHT_OVERDUE;
+    return IN_FLIGHT;
+}
+
+bool PendingQueries::join(const QByteArray &question, const DNSInfo &respondTo)
+{
+    auto lookup = byQuestion.constFind(question);
+    if(lookup == byQuestion.constEnd())
+        return false;
+
+    inFlight[lookup.value()].waiters.push_back(respondTo);
+    return true;
+}
+
+bool PendingQueries::add(const QByteArray &question, const DNSInfo *respondTo, const QHostAddress &upstream, quint16 upstreamPort, quint16 &upstreamID,
+                         bool prefetch, qint64 staleAfterMs)
+{
+    if(inFlight.size() >= PENDING_QUERY_LIMIT)
+        return false;
+
+    //The table is never more than a quarter full, so this hardly ever takes more than one try
+    do upstreamID = (quint16)QRandomGenerator::global()->bounded(65536);
+    while(inFlight.contains(upstreamID));
+
+    Entry &e = inFlight[upstreamID];
+    e.question = question;
+    if(respondTo)
+        e.waiters.push_back(*respondTo);
+    e.upstream = upstream;
+    e.upstreamPort = upstreamPort;
+    e.serial = nextSerial++;
+    e.sentAt = QDateTime::currentMSecsSinceEpoch();
+    e.staleAt = (staleAfterMs >= 0) ? e.sentAt + staleAfterMs : 0;
+    e.prefetch = prefetch;
+
+    Deadline d;
+    d.at = e.sentAt + PENDING_QUERY_TIMEOUT_MS;
+    d.id = upstreamID;
+    d.serial = e.serial;
+    deadlines.push_back(d);
+    if(e.staleAt != 0)
+    {
+        d.at = e.staleAt;
+        staleDeadlines.push_back(d);
+    }
+
+    if(!question.isEmpty())
+        byQuestion.insert(question, upstreamID);
+    return true;
+}
+
+bool PendingQueries::take(quint16 upstreamID, const QHostAddress &upstream, quint16 upstreamPort, const QByteArray &question, Lookup &done)
+{
+    auto it = inFlight.find(upstreamID);
+    if(it == inFlight.end())
+        return false;
+
+    //A reply with the right ID from anywhere else isn't ours (the socket may report v4 senders as v4-mapped v6, hence tolerant),
+    //and neither is one answering some other question
+    if(it->upstreamPort != upstreamPort || !it->upstream.isEqual(upstream, QHostAddress::TolerantConversion) || it->question != question)
+        return false;
+
+    done.question = it->question;
+    done.waiters.swap(it->waiters);
+    done.sentAt = it->sentAt;
+    done.prefetch = it->prefetch;
+    byQuestion.remove(it->question);
+    inFlight.erase(it);
+    return true;
+}
+
+void PendingQueries::popDue(std::deque<Deadline> &queue, qint64 now, std::vector<Deadline> &due)
+{
+    while(!queue.empty() && queue.front().at <= now)
+    {
+        due.push_back(queue.front());
+        queue.pop_front();
+    }
+}
+
+void PendingQueries::expire(std::vector<Lookup> &timedOut)
+{
+    std::vector<Deadline> due;
+    popDue(deadlines, QDateTime::currentMSecsSinceEpoch(), due);
+    for(const Deadline &d : due)
+    {
+        auto it = inFlight.find(d.id);
+        if(it == inFlight.end() || it->serial != d.serial)
+            continue; //Answered already
+
+        qDebug() << "No response came for lookup id:" << d.id << "giving up on it along with the" << it->waiters.size() << "queries waiting on it";
+        Lookup lookup;
+        lookup.question = it->question;
+        lookup.waiters.swap(it->waiters);
+        lookup.sentAt = it->sentAt;
+        lookup.prefetch = it->prefetch;
+        timedOut.push_back(lookup);
+        byQuestion.remove(it->question);
+        inFlight.erase(it);
+    }
+
+    //Answered queries leave their deadlines behind, only worth keeping around while something's still in flight
+    if(inFlight.isEmpty())
+    {
+        deadlines.clear();
+        staleDeadlines.clear();
+    }
+}
+
+void PendingQueries::takeOverdue(std::vector<Lookup> &overdue)
+{
+    //The lookups stay in flight (their response still refreshes the cache), only the waiters are taken
+    std::vector<Deadline> due;
+    popDue(staleDeadlines, QDateTime::currentMSecsSinceEpoch(), due);
+    for(const Deadline &d : due)
+    {
+        auto it = inFlight.find(d.id);
+        if(it == inFlight.end() || it->serial != d.serial || it->waiters.empty())
+            continue;
+
+        Lookup lookup;
+        lookup.question = it->question;
+        lookup.waiters.swap(it->waiters);
+        lookup.sentAt = it->sentAt;
+        overdue.push_back(lookup);
+    }
+}
+
+void PendingQueries::giveBack(Lookup &overdue)
+{
+    //An overdue lookup's waiters that couldn't be answered stale after all, they wait on its response again like they did before
+    auto id = byQuestion.constFind(overdue.question);
+    if(id == byQuestion.constEnd())
+        return;
+    auto it = inFlight.find(id.value());
+    if(it == inFlight.end())
+        return;
+    it->waiters.insert(it->waiters.begin(), overdue.waiters.begin(), overdue.waiters.end());
+}
+
+void PendingQueries::clear()
+{
+    inFlight.clear();
+    byQuestion.clear();
+    deadlines.clear();
+    staleDeadlines.clear();
+}
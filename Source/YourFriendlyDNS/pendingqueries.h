@@ -0,0 +1,105 @@
+#ifndef PENDINGQUERIES_H
+#define PENDINGQUERIES_H
+
+#include <QHostAddress>
+#include <QHash>
+#include <QDateTime>
+#include <QRandomGenerator>
+#include <deque>
+#include <vector>
+#include "dnsinfo.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define PENDING_QUERY_TIMEOUT_MS 15000
+#define PENDING_QUERY_LIMIT 16384
+
+//Every query forwarded upstream goes out with a transaction ID picked here (random and unique among the ones in flight),
+//so a reply finds who asked for it with one lookup of (ID, upstream endpoint) instead of being shown to every outstanding query.
+//Encrypted lookups come back already matched to their socket, those are added with a null endpoint.
+//Clients asking the same question while it's still in flight just join the lookup that's already out there (single-flight),
+//and all of them get answered from that one response.
+//Background prefetches are lookups nobody's waiting on (yet), and lookups refreshing an expired entry can be given
+//a stale deadline, after which their waiters are handed back to be answered with the stale data instead (RFC 8767).
+class PendingQueries
+{
+public:
+    enum State { NOT_IN_FLIGHT, IN_FLIGHT, IN_FLIGHT_OVERDUE };
+
+    //A lookup that's completed, timed out or gone past its stale deadline, with whoever was waiting on it
+    struct Lookup
+    {
+        Lookup() { sentAt = 0; prefetch = false; }
+        QByteArray question;
+        std::vector<DNSInfo> waiters;
+        qint64 sentAt;
+        bool prefetch;
+    };
+
+    PendingQueries();
+    State state(const QByteArray &question) const;
+    bool join(const QByteArray &question, const DNSInfo &respondTo);
+    bool add(const QByteArray &question, const DNSInfo *respondTo, const QHostAddress &upstream, quint16 upstreamPort, quint16 &upstreamID,
+             bool prefetch = false, qint64 staleAfterMs = -1);
+    bool take(quint16 upstreamID, const QHostAddress &upstream, quint16 upstreamPort, const QByteArray &question, Lookup &done);
+    void expire(std::vector<Lookup> &timedOut);
+    void takeOverdue(std::vector<Lookup> &overdue);
+    void giveBack(Lookup &overdue);
+    void clear();
+    int size() const { return inFlight.size(); }
+
+private:
+    struct Entry
+    {
+        QByteArray question;
+        std::vector<DNSInfo> waiters; //The client that caused the lookup first, then everyone who joined it
+        QHostAddress upstream;
+        quint16 upstreamPort;
+        quint32 serial;
+        qint64 sentAt, staleAt; //staleAt is 0 when there's nothing stale to fall back on
+        bool prefetch;
+    };
+
+    //Every entry gets the same timeout, so deadlines come out of here in the order they went in.
+    //The serial tells a deadline apart from a later query that reused the same ID.
+    struct Deadline
+    {
+        qint64 at;
+        quint16 id;
+        quint32 serial;
+    };
+
+    static void popDue(std::deque<Deadline> &queue, qint64 now, std::vector<Deadline> &due);
+
+    QHash<quint16, Entry> inFlight;
+    QHash<QByteArray, quint16> byQuestion; //Question section (as DNSCache keys it) -> upstream ID of the lookup for it
+    std::deque<Deadline> deadlines, staleDeadlines;
+    quint32 nextSerial;
+};
+
+#endif // PENDINGQUERIES_H
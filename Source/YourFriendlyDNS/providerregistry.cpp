@@ -0,0 +1,106 @@
+#include "providerregistry.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+ProviderRegistry::ProviderRegistry(const QVector<QString> &entries)
+{
+    sourceEntries = entries;
+    for(const QString &entry : entries)
+        add(entry);
+
+    //Never without one of each, the defaults are used when the list doesn't have any
+    if(plain.isEmpty())
+    {
+        add("208.67.222.222:53");
+        add("208.67.220.220:53");
+    }
+    if(encrypted.isEmpty())
+        add(DNSCRYPT_DEFAULT_STAMP);
+}
+
+void ProviderRegistry::add(const QString &entry)
+{
+    UpstreamProvider provider;
+    provider.entry = entry;
+    provider.props = 0;
+
+    if(!entry.contains("sdns://"))
+    {
+        QString addr = entry;
+        provider.protocolVersion = 0;
+        provider.port = DNSInfo::extractPort(addr);
+        if(provider.port == 0 || provider.port == 443)
+            provider.port = 53;
+        provider.address = QHostAddress(addr);
+        if(provider.address.isNull())
+        {
+            qDebug() << "Skipping upstream dns server that isn't an ip address:" << entry;
+            return;
+        }
+        plain.append(providers.size());
+    }
+    else
+    {
+        DNSCryptProvider stamp(entry.toUtf8());
+        if(stamp.protocolVersion < 1 || stamp.protocolVersion > 3)
+        {
+            qDebug() << "Skipping invalid or unsupported stamp:" << entry;
+            return;
+        }
+        provider.protocolVersion = stamp.protocolVersion;
+        provider.props = stamp.props;
+        provider.port = stamp.port;
+        if(!stamp.addr.isEmpty())
+            provider.address = QHostAddress(stamp.addr);
+        provider.providerName = stamp.providerName;
+        provider.hostname = stamp.hostname;
+        provider.path = stamp.path;
+        provider.providerKey = stamp.providerPubKey;
+        if(provider.protocolVersion != 1)
+            v2and3Hostnames.insert(provider.hostname);
+        stamps.insert(entry);
+        encrypted.append(providers.size());
+    }
+
+    byProtocol[provider.protocolVersion].append(providers.size());
+    providers.append(provider);
+}
+
+QVector<QString> ProviderRegistry::bootstrapHostnames() const
+{
+    QVector<QString> hostnames;
+    for(quint8 version = 2; version <= 3; version++)
+    {
+        for(int i : byProtocol[version])
+        {
+            if(providers[i].address.isNull() && !hostnames.contains(providers[i].hostname))
+                hostnames.append(providers[i].hostname);
+        }
+    }
+    return hostnames;
+}
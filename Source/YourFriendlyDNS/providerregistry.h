@@ -0,0 +1,77 @@
+#ifndef PROVIDERREGISTRY_H
+#define PROVIDERREGISTRY_H
+
+#include <QString>
+#include <QVector>
+#include <QSet>
+#include <QHostAddress>
+#include <QRandomGenerator>
+#include <QDebug>
+#include "dnscrypt.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+//One upstream from the settings' server list, decoded once
+struct UpstreamProvider
+{
+    QString entry; //As it's written in the settings, the stamp itself for encrypted ones
+    quint8 protocolVersion; //0 plain dns, 1 DNSCrypt, 2 DoH, 3 DoT
+    quint64 props;
+    QHostAddress address; //Null for DoH/DoT stamps without one, those are bootstrapped
+    quint16 port;
+    QString providerName, hostname, path;
+    QByteArray providerKey;
+};
+
+//Every upstream provider parsed up front and indexed by protocol, built again only when the server list changes and never modified after,
+//so workers share one between them. Picking a random provider of a kind is a single draw from its index.
+class ProviderRegistry
+{
+public:
+    explicit ProviderRegistry(const QVector<QString> &entries);
+    bool builtFrom(const QVector<QString> &entries) const { return sourceEntries == entries; }
+    const UpstreamProvider& randomPlain() const { return pick(plain); }
+    const UpstreamProvider& randomEncrypted() const { return pick(encrypted); }
+    const QVector<int>& withProtocol(quint8 version) const { return byProtocol[qMin(version, (quint8)3)]; }
+    const UpstreamProvider& at(int i) const { return providers[i]; }
+    //DoH/DoT hostnames are resolved through the dedicated DNSCrypt provider, the providers themselves can't be used for that
+    bool isEncryptedProviderHost(const QString &hostname) const { return v2and3Hostnames.contains(hostname); }
+    QVector<QString> bootstrapHostnames() const;
+    const QSet<QString>& encryptedStamps() const { return stamps; }
+
+private:
+    void add(const QString &entry);
+    const UpstreamProvider& pick(const QVector<int> &index) const { return providers[index[index.size() == 1 ? 0 : QRandomGenerator::global()->bounded(index.size())]]; }
+
+    QVector<QString> sourceEntries;
+    QVector<UpstreamProvider> providers;
+    QVector<int> plain, encrypted, byProtocol[4];
+    QSet<QString> v2and3Hostnames, stamps;
+};
+
+#endif // PROVIDERREGISTRY_H
@@ -1,5 +1,11 @@
 #include "smalldnsserver.h"
 
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
 /* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
 Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
 Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
@@ -27,14 +33,30 @@ You should have received a copy of the GNU General Public License along
 with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
 
-SmallDNSServer::SmallDNSServer(QObject *parent)
+SmallDNSServer::SmallDNSServer(SharedDNSCache *sharedCache, QObject *parent)
 {
     Q_UNUSED(parent);
+    //Worker servers answer out of the primary server's cache, the primary (or a lone server) owns its own
+    ownsCache = (sharedCache == nullptr);
+    dnsCache = ownsCache ? new SharedDNSCache() : sharedCache;
     ipToRespondWith = QHostAddress("127.0.0.1").toIPv4Address();
     cachedMinutesValid = 7;
     dnsTTL = 4200;
+    //Cache entries live as long as the smallest TTL in their answers (kept within these bounds), or cachedMinutesValid if honorUpstreamTTL is off
+    honorUpstreamTTL = true;
+    minCacheTTL = 30;
+    maxCacheTTL = 86400;
+    maxNegativeCacheTTL = 10800; //RFC 2308 suggests 1-3 hours at most
+    cacheMemoryMB = CACHE_DEFAULT_BUDGET_MB;
+    //Refresh names asked for at least a few times once 90% of their TTL has gone by, and answer with
+    //expired data (for up to a day past expiry) when a refresh takes longer than 1.8s or fails
+    prefetchEnabled = serveStale = true;
+    prefetchFraction = 0.9;
+    prefetchMinHits = 3;
+    staleAnswerDelayMs = 1800;
+    staleMaxAge = 86400;
     inTimeout = 0;
-    numSentRequests = numReceivedResponses = 0;
+    numSentRequests = numReceivedResponses = numCoalescedQueries = 0;
     dnscryptEnabled = true; //Encryption now enabled by default (and there's no fallback to plaintext dns either for security, you have to manually disable it to use regular dns again)
     dedicatedDNSCrypter = "sdns://AQAAAAAAAAAADjIwOC42Ny4yMjAuMjIwILc1EUAgbyJdPivYItf9aR6hwzzI1maNDL4Ev6vKQ_t5GzIuZG5zY3J5cHQtY2VydC5vcGVuZG5zLmNvbQ";
 
@@ -66,127 +88,220 @@ SmallDNSServer::SmallDNSServer(QObject *parent)
     blacklist.push_back(ListEntry("clients3.google.com"));
     blacklist.push_back(ListEntry("captive.apple.com"));
 
-    connect(&serversock, &QUdpSocket::readyRead, this, &SmallDNSServer::processDNSRequests);
-    connect(&clientsock, &QUdpSocket::readyRead, this, &SmallDNSServer::processLookups);
     dnscrypt = new DNSCrypt();
     if(dnscrypt)
         connect(dnscrypt, &DNSCrypt::decryptedLookupDoneSendResponseNow, this, &SmallDNSServer::decryptedLookupDoneSendResponseNow);
-}
 
-bool SmallDNSServer::startServer(QHostAddress address, quint16 port, bool reuse)
-{ 
-    return serversock.bind(address, port, reuse ? QUdpSocket::ReuseAddressHint : QUdpSocket::DefaultForPlatform);
+    //Workers take everything, providers included, from the primary's published settings before they start answering
+    if(ownsCache)
+        compileLists();
+
+    connect(&serversock, &QUdpSocket::readyRead, this, &SmallDNSServer::processDNSRequests);
+    connect(&clientsock, &QUdpSocket::readyRead, this, &SmallDNSServer::processLookups);
+    connect(&pendingExpiryTimer, &QTimer::timeout, this, &SmallDNSServer::expirePendingQueries);
+    pendingExpiryTimer.start(250); //Often enough for the stale answer latency budget
 }
 
-void SmallDNSServer::clearDNSCache()
+SmallDNSServer::~SmallDNSServer()
 {
-    cachedDNSResponses.clear();
-    qDebug() << "Local DNS cache cleared!";
+    if(ownsCache)
+        delete dnsCache;
+    delete dnscrypt;
 }
 
-void SmallDNSServer::deleteEntriesFromCache(std::vector<ListEntry> entries)
+bool SmallDNSServer::startServer(QHostAddress address, quint16 port, bool reuse, bool reusePort)
 {
-    DNSInfo cmp;
-    size_t deletionSize = entries.size();
-    qDebug() << "# cached:" << cachedDNSResponses.size() << "# deleting:" << deletionSize;
-    for(size_t x = 0; x < deletionSize; x++)
-    {
-        cmp.domainString = entries[x].hostname;
-        cmp.question.qtype = entries[x].ip;
-
-        std::remove(cachedDNSResponses.begin(), cachedDNSResponses.end(), cmp);
-    }
-
-    qDebug() << "Deleting...";
-    cachedDNSResponses.erase(cachedDNSResponses.end() - deletionSize, cachedDNSResponses.end());
+    if(reusePort)
+        return bindReusePort(address, port);
+    return serversock.bind(address, port, reuse ? QUdpSocket::ReuseAddressHint : QUdpSocket::DefaultForPlatform);
 }
 
-void SmallDNSServer::determineDoHDoTLSProviders()
+bool SmallDNSServer::reusePortBalancesLoad()
 {
-    //When using only DoH and DoTLS (v2, v3) providers, a dedicated v1 DNSCrypt provider is used to resolve their hosts,
-    //then DoH and DoTLS providers can be used without any issue.
-    //QSslSocket::connectToHostEncrypted only takes a hostname, and when YourFriendlyDNS is set as system dns
-    //it uses this server to try and resolve it, which I solved by using a dedicated v1 provider when that's happening.
-    v2and3Providers.clear();
-    for(QString &p : realdns)
-    {
-        if(p.contains("sdns://"))
-        {
-            DNSCryptProvider provider(p.toUtf8());
-            if(provider.protocolVersion == 2 || provider.protocolVersion == 3)
-                v2and3Providers.append(provider.hostname);
-        }
-    }
+    //Only Linux (and so Android) spreads incoming datagrams across every socket bound with SO_REUSEPORT,
+    //elsewhere the option exists but one socket ends up getting everything, so there's no point in extra workers
+    #if defined(Q_OS_LINUX) && defined(SO_REUSEPORT)
+    return true;
+    #else
+    return false;
+    #endif
 }
 
-QString SmallDNSServer::selectRandomDNSServer()
+bool SmallDNSServer::bindReusePort(const QHostAddress &address, quint16 port)
 {
-    bool hasDNSProviders = false;
-    for(QString &i : realdns)
+    //QUdpSocket::bind has no SO_REUSEPORT hint, so the socket is made and bound natively and then handed over to Qt
+    #if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+    bool ipv4 = (address.protocol() == QAbstractSocket::IPv4Protocol);
+    int fd = ::socket(ipv4 ? AF_INET : AF_INET6, SOCK_DGRAM, 0);
+    if(fd < 0)
+        return false;
+
+    int on = 1, off = 0, bound;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if(ipv4)
     {
-        if(!i.contains("sdns://"))
-        {
-            hasDNSProviders = true;
-            break;
-        }
+        sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = qToBigEndian(port);
+        sa.sin_addr.s_addr = qToBigEndian(address.toIPv4Address());
+        bound = ::bind(fd, (sockaddr*)&sa, sizeof(sa));
     }
-
-    if(!hasDNSProviders)
+    else
     {
-        realdns.append("208.67.222.222:53");
-        realdns.append("208.67.220.220:53");
+        //QHostAddress::Any means both protocols, same as what QUdpSocket::bind does with it
+        bool dualStack = (address == QHostAddress::Any);
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, dualStack ? &off : &on, sizeof(int));
+        Q_IPV6ADDR ipv6 = dualStack ? QHostAddress(QHostAddress::AnyIPv6).toIPv6Address() : address.toIPv6Address();
+
+        sockaddr_in6 sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = qToBigEndian(port);
+        memcpy(&sa.sin6_addr, &ipv6, sizeof(sa.sin6_addr));
+        bound = ::bind(fd, (sockaddr*)&sa, sizeof(sa));
     }
 
-    for(int x = 0; ; x++)
+    if(bound != 0 || !serversock.setSocketDescriptor(fd, QUdpSocket::BoundState))
     {
-        QString randomServer = realdns[QRandomGenerator::global()->bounded(realdns.size())];
+        qDebug() << "Couldn't bind a SO_REUSEPORT socket to port:" << port;
+        ::close(fd);
+        return false;
+    }
+    return true;
+    #else
+    Q_UNUSED(address);
+    Q_UNUSED(port);
+    return false;
+    #endif
+}
 
-        if(!randomServer.contains("sdns://"))
-            return randomServer;
+void SmallDNSServer::clearDNSCache()
+{
+    dnsCache->clear();
+    qDebug() << "Local DNS cache cleared!";
+}
 
-        if(x > 100000)
-            break;
-    }
+void SmallDNSServer::compileLists()
+{
+    whitelistMatcher = ListMatcher(whitelist);
+    blacklistMatcher = ListMatcher(blacklist);
+    publishSettings();
+}
 
-    return "208.67.222.222:53";
+void SmallDNSServer::publishSettings()
+{
+    rebuildProviders();
+    closeUnusedSessions();
+
+    //The cache is shared, only the server that owns it sizes it
+    if(ownsCache)
+        dnsCache->setMemoryBudget((size_t)cacheMemoryMB * 1024 * 1024);
+
+    //The UI only ever talks to the primary server, this hands a copy of its current settings on to every worker
+    ServerSettings *settings = new ServerSettings;
+    settings->whitelistmode = whitelistmode;
+    settings->blockmode_returnlocalhost = blockmode_returnlocalhost;
+    settings->initialMode = initialMode;
+    settings->autoTTL = autoTTL;
+    settings->dnscryptEnabled = dnscryptEnabled;
+    settings->ipToRespondWith = ipToRespondWith;
+    settings->ipv6ToRespondWith = ipv6ToRespondWith;
+    settings->cachedMinutesValid = cachedMinutesValid;
+    settings->dnsTTL = dnsTTL;
+    settings->honorUpstreamTTL = honorUpstreamTTL;
+    settings->minCacheTTL = minCacheTTL;
+    settings->maxCacheTTL = maxCacheTTL;
+    settings->cacheMemoryMB = cacheMemoryMB;
+    settings->maxNegativeCacheTTL = maxNegativeCacheTTL;
+    settings->prefetchEnabled = prefetchEnabled;
+    settings->serveStale = serveStale;
+    settings->prefetchFraction = prefetchFraction;
+    settings->prefetchMinHits = prefetchMinHits;
+    settings->staleAnswerDelayMs = staleAnswerDelayMs;
+    settings->staleMaxAge = staleMaxAge;
+    settings->dedicatedDNSCrypter = dedicatedDNSCrypter;
+    settings->whitelist = whitelist;
+    settings->blacklist = blacklist;
+    //The already compiled matchers go along too, saving every worker from compiling the same lists again
+    settings->whitelistMatcher = whitelistMatcher;
+    settings->blacklistMatcher = blacklistMatcher;
+    settings->realdns = realdns;
+    settings->providers = providers;
+    settings->listeningIPs = listeningIPs;
+    settings->listeningIPv6s = listeningIPv6s;
+    settings->newKeyPerRequest = dnscrypt->newKeyPerRequest;
+    lastPublished = ServerSettingsSnapshot(settings);
+    emit settingsPublished(lastPublished);
 }
 
-QString SmallDNSServer::selectRandomDNSCryptServer()
+void SmallDNSServer::adoptSettings(ServerSettingsSnapshot settings)
 {
-    QString oneProvider;
-    bool hasDNSCryptProviders = false;
-    quint32 providerCount = 0;
-    for(QString &i : realdns)
-    {
-        if(i.contains("sdns://"))
-        {
-            oneProvider = i;
-            hasDNSCryptProviders = true;
-            providerCount++;
-        }
-    }
-    if(!hasDNSCryptProviders)
+    whitelistmode = settings->whitelistmode;
+    blockmode_returnlocalhost = settings->blockmode_returnlocalhost;
+    initialMode = settings->initialMode;
+    autoTTL = settings->autoTTL;
+    dnscryptEnabled = settings->dnscryptEnabled;
+    ipToRespondWith = settings->ipToRespondWith;
+    ipv6ToRespondWith = settings->ipv6ToRespondWith;
+    cachedMinutesValid = settings->cachedMinutesValid;
+    dnsTTL = settings->dnsTTL;
+    honorUpstreamTTL = settings->honorUpstreamTTL;
+    minCacheTTL = settings->minCacheTTL;
+    maxCacheTTL = settings->maxCacheTTL;
+    cacheMemoryMB = settings->cacheMemoryMB;
+    maxNegativeCacheTTL = settings->maxNegativeCacheTTL;
+    prefetchEnabled = settings->prefetchEnabled;
+    serveStale = settings->serveStale;
+    prefetchFraction = settings->prefetchFraction;
+    prefetchMinHits = settings->prefetchMinHits;
+    staleAnswerDelayMs = settings->staleAnswerDelayMs;
+    staleMaxAge = settings->staleMaxAge;
+    dedicatedDNSCrypter = settings->dedicatedDNSCrypter;
+    whitelist = settings->whitelist;
+    blacklist = settings->blacklist;
+    whitelistMatcher = settings->whitelistMatcher;
+    blacklistMatcher = settings->blacklistMatcher;
+    realdns = settings->realdns;
+    providers = settings->providers; //Immutable, so it's shared instead of parsed again
+    listeningIPs = settings->listeningIPs;
+    listeningIPv6s = settings->listeningIPv6s;
+    dnscrypt->newKeyPerRequest = settings->newKeyPerRequest;
+    closeUnusedSessions();
+}
+
+void SmallDNSServer::deleteEntriesFromCache(std::vector<ListEntry> entries)
+{
+    qDebug() << "# cached:" << dnsCache->size() << "# deleting:" << entries.size();
+    for(ListEntry &e : entries)
     {
-        realdns.append("sdns://AQAAAAAAAAAADjIwOC42Ny4yMjAuMjIwILc1EUAgbyJdPivYItf9aR6hwzzI1maNDL4Ev6vKQ_t5GzIuZG5zY3J5cHQtY2VydC5vcGVuZG5zLmNvbQ");
-        return realdns.last();
+        //The cache viewer reuses the ip field as the record type
+        dnsCache->remove(DNSCache::makeKey(e.hostname, e.ip));
     }
-    else if(providerCount == 1)
-        return oneProvider;
+}
 
-    for(size_t x = 0; ; x++)
-    {
-        QString randomServer = realdns[QRandomGenerator::global()->bounded(realdns.size())];
+void SmallDNSServer::rebuildProviders()
+{
+    //Only when the server list actually changed, everything else that's published doesn't touch it
+    if(providers && providers->builtFrom(realdns))
+        return;
+    providers = QSharedPointer<const ProviderRegistry>(new ProviderRegistry(realdns));
 
-        if(randomServer.contains("sdns://"))
-        {
-            qDebug() << "Selected:" << randomServer;
-            return randomServer;
-        }
+    //When using only DoH and DoTLS (v2, v3) providers, a dedicated v1 DNSCrypt provider is used to resolve their hosts,
+    //then DoH and DoTLS providers can be used without any issue.
+    //QSslSocket::connectToHostEncrypted only takes a hostname, and when YourFriendlyDNS is set as system dns
+    //it uses this server to try and resolve it, which I solved by using a dedicated v1 provider when that's happening.
+    //The ones without an address in their stamp are also bootstrapped in the background, so connecting to them doesn't have to wait on that.
+    //The resolver's shared by every thread, only the server whose settings everyone else adopts gives it hostnames
+    if(ownsCache)
+        BootstrapResolver::instance()->setHostnames(providers->bootstrapHostnames());
+}
 
-        if(x > 100000)
-            break;
-    }
-    return "sdns://AQAAAAAAAAAADjIwOC42Ny4yMjAuMjIwILc1EUAgbyJdPivYItf9aR6hwzzI1maNDL4Ev6vKQ_t5GzIuZG5zY3J5cHQtY2VydC5vcGVuZG5zLmNvbQ";
+void SmallDNSServer::closeUnusedSessions()
+{
+    QSet<QString> inUse = providers->encryptedStamps();
+    inUse.insert(dedicatedDNSCrypter);
+    dnscrypt->pruneSessions(inUse);
 }
 
 bool SmallDNSServer::weDoStillHaveAConnection()
@@ -215,7 +330,6 @@ bool SmallDNSServer::weDoStillHaveAConnection()
         {
             responseLastReceivedTime = requestLastSentTime = QDateTime::currentDateTime();
             inTimeout = 0;
-            emit deleteObjectsTheresNoResponseFor();
             return true;
         }
         return false;
@@ -239,10 +353,9 @@ void SmallDNSServer::processDNSRequests()
 
         bool shouldCacheDomain, useDedicatedDNSCryptProviderToResolveV2And3Hosts = false;
         quint32 customIP = ipToRespondWith;
-        std::string domain = (char*)dns.domainString.toUtf8().data();
         if(whitelistmode)
         {
-            ListEntry *whiteListed = getListEntry(domain, TYPE_WHITELIST);
+            const ListEntry *whiteListed = getListEntry(dns.domainString, TYPE_WHITELIST);
             if(whiteListed)
             {
                 qDebug() << "Matched WhiteList!" << whiteListed->hostname << "to:" << dns.domainString;
@@ -254,7 +367,7 @@ void SmallDNSServer::processDNSRequests()
         }
         else
         {
-            ListEntry *blackListed = getListEntry(domain, TYPE_BLACKLIST);
+            const ListEntry *blackListed = getListEntry(dns.domainString, TYPE_BLACKLIST);
             if(blackListed)
             {
                 qDebug() << "Matched BlackList!" << blackListed->hostname << "to:" << dns.domainString;
@@ -269,14 +382,7 @@ void SmallDNSServer::processDNSRequests()
             //Trying to exclude local hostnames from leaking
             shouldCacheDomain = (dns.domainString.contains(".") && !dns.domainString.endsWith("in-addr.arpa") && !dns.domainString.endsWith(".lan"));
 
-            for(QString &provider : v2and3Providers)
-            {
-                if(provider == dns.domainString)
-                {
-                    useDedicatedDNSCryptProviderToResolveV2And3Hosts = true;
-                    break;
-                }
-            }
+            useDedicatedDNSCryptProviderToResolveV2And3Hosts = providers->isEncryptedProviderHost(dns.domainString);
         }
 
         //Rewritten and shortened
@@ -294,63 +400,25 @@ void SmallDNSServer::processDNSRequests()
         }
         else if(shouldCacheDomain)
         {
-            DNSInfo *cached = getCachedEntry(dns.domainString, dns.question.qtype);
-            if(cached)
-                shouldCacheDomain = (QDateTime::currentDateTime() > cached->expiry);
+            QByteArray cacheKey = DNSCache::makeKey(datagram, dns.answeroffset);
+            DNSInfo cachedCopy;
+            int popularity = 0;
+            DNSInfo *cached = dnsCache->lookup(cacheKey, cachedCopy, &popularity) ? &cachedCopy : nullptr;
+            QDateTime now = QDateTime::currentDateTime();
 
-            if(shouldCacheDomain)
-            {
-                if(!weDoStillHaveAConnection()) return;
-
-                qDebug() << "Caching this domain->" << dns.domainString;
-                if(cached) //If cached, update the expiry now, even though we're about to update it again in a moment
-                    cached->expiry = QDateTime::currentDateTime().addSecs(cachedMinutesValid * 60);
-
-                //Here's where we forward the received request to a real dns server, if not cached yet or its time to update the cache for this domain
-                //Only executes if the domain is whitelisted or not blacklisted (depending on which mode you're using)
-
-                dns.sender = sender;
-                dns.senderPort = senderPort;
-                dns.ttl = dnsTTL;
-
-                if(dnscryptEnabled)
-                {
-                    qDebug() << "Making encrypted DNS request type:" << dns.question.qtype << "for domain:" << dns.domainString << "request id:" << dns.header.id << "datagram:" << datagram;
-                    if(useDedicatedDNSCryptProviderToResolveV2And3Hosts)
-                    {
-                        dnscrypt->setProvider(dedicatedDNSCrypter);
-                        qDebug() << "Using dedicated DNSCrypt provider to resolve DoH/DoTLS provider's host:" << dns.domainString;
-                    }
-                    else
-                        dnscrypt->setProvider(selectRandomDNSCryptServer());
-
-                    dnscrypt->makeEncryptedRequest(dns);
-                }
-                else
-                {
-                    qDebug() << "Making DNS request type:" << dns.question.qtype << "for domain:" << dns.domainString << "request id:" << dns.header.id << "datagram:" << datagram;
-                    QString server = selectRandomDNSServer();
-                    quint16 serverPort = DNSInfo::extractPort(server);
-                    if(serverPort == 0 || serverPort == 443) serverPort = 53;
-                    clientsock.writeDatagram(datagram, QHostAddress(server), serverPort);
-                }
+            dns.sender = sender;
+            dns.senderPort = senderPort;
+            dns.ttl = dnsTTL;
 
-                InitialResponse *ir = new InitialResponse(dns);
-                if(ir)
-                {
-                    connect(this, &SmallDNSServer::lookupDoneSendResponseNow, ir, &InitialResponse::lookupDoneSendResponseNow);
-                    connect(this, &SmallDNSServer::deleteObjectsTheresNoResponseFor, ir, &InitialResponse::deleteObjectsTheresNoResponseFor);
-                }
-                requestLastSentTime = QDateTime::currentDateTime();
-                sendrecvFlag = 0;
-            }
-            else if(cached)
+            if(cached && now <= cached->expiry)
             {
-                if(dns.question.qtype == DNS_TYPE_A)
+                //Whatever we hand out from the cache only has as long to live as the cache entry itself has left
+                qint64 remaining = qMax(now.secsTo(cached->expiry), (qint64)0);
+                if(dns.question.qtype == DNS_TYPE_A && !(cached->negative && !cached->hasIPs))
                 {
                     if(cached->ipaddresses.size() == 0) cached->ipaddresses.push_back(ipToRespondWith);
                     //Let's use our cached IPs, and morph this request into a response containing them as appended dns answers
-                    morphRequestIntoARecordResponse(datagram, cached->ipaddresses, dns.answeroffset, dnsTTL);
+                    morphRequestIntoARecordResponse(datagram, cached->ipaddresses, dns.answeroffset, honorUpstreamTTL ? (quint32)remaining : dnsTTL);
                     serversock.writeDatagram(datagram, sender, senderPort);
                     emit queryRespondedTo(ListEntry(dns.domainString, cached->ipaddresses[0]));
                     qDebug() << "Cached IPs returned! (first one):" << QHostAddress(cached->ipaddresses[0]) << "for domain:" << dns.domainString;
@@ -358,59 +426,248 @@ void SmallDNSServer::processDNSRequests()
                 else
                 {
                     *(quint16*)cached->res.data() = *(quint16*)dns.req.data();
+                    if(honorUpstreamTTL)
+                        rewriteTTLs(cached->res, cached->answeroffset, cached->cachedAt.secsTo(now));
                     serversock.writeDatagram(cached->res, sender, senderPort);
                     qDebug() << "Cached other record returned! of type:" << cached->question.qtype << "for domain:" << dns.domainString;
                 }
+                if(cached->prefetched)
+                    dnsCache->countPrefetchHit();
+                if(cached->negative)
+                    dnsCache->countNegativeHit();
+
+                //Popular names get refreshed in the background once they're most of the way through their TTL,
+                //so nobody ends up waiting on upstream for them (popularity is the cache's frequency sketch count, 15 at most)
+                qint64 lifetime = cached->cachedAt.secsTo(cached->expiry);
+                if(prefetchEnabled && popularity >= (int)prefetchMinHits && cached->cachedAt.secsTo(now) >= (qint64)(lifetime * prefetchFraction)
+                   && pendingQueries.state(cacheKey) == PendingQueries::NOT_IN_FLIGHT && weDoStillHaveAConnection())
+                {
+                    qDebug() << "Prefetching popular domain:" << dns.domainString << "type:" << dns.question.qtype << "with" << remaining << "secs left";
+                    DNSInfo prefetch = dns;
+                    if(forwardQuery(prefetch, cacheKey, false, useDedicatedDNSCryptProviderToResolveV2And3Hosts, true))
+                        dnsCache->countPrefetch();
+                }
+                continue;
+            }
+
+            //Expired entries are kept, so if upstream is slow or failing they can still be served with a short TTL (RFC 8767)
+            bool staleUsable = (cached && serveStale && cached->expiry.secsTo(now) <= (qint64)staleMaxAge);
+            PendingQueries::State inFlight = pendingQueries.state(cacheKey);
+            if(inFlight == PendingQueries::IN_FLIGHT_OVERDUE && staleUsable)
+            {
+                answerStale(dns, *cached);
+                continue;
+            }
+
+            //Someone already asked this and the answer's on its way, so this one just waits for it too
+            if(inFlight != PendingQueries::NOT_IN_FLIGHT && pendingQueries.join(cacheKey, dns))
+            {
+                numCoalescedQueries++;
+                qDebug() << "Joined the lookup already in flight for:" << dns.domainString << "type:" << dns.question.qtype << "upstream queries saved so far:" << numCoalescedQueries;
+                continue;
+            }
+
+            if(!weDoStillHaveAConnection())
+            {
+                if(staleUsable)
+                {
+                    answerStale(dns, *cached);
+                    continue;
+                }
+                return;
             }
+
+            //Here's where we forward the received request to a real dns server, if not cached yet or its time to update the cache for this domain
+            //Only executes if the domain is whitelisted or not blacklisted (depending on which mode you're using)
+            qDebug() << "Caching this domain->" << dns.domainString;
+            forwardQuery(dns, cacheKey, true, useDedicatedDNSCryptProviderToResolveV2And3Hosts, false, staleUsable ? (qint64)staleAnswerDelayMs : -1);
         }
     }
 }
 
-void SmallDNSServer::parseAndRespond(QByteArray &datagram, DNSInfo &dns)
+bool SmallDNSServer::forwardQuery(DNSInfo &dns, const QByteArray &question, bool clientWaits, bool useDedicatedProvider, bool prefetch, qint64 staleAfterMs)
 {
-    parseResponse(datagram, dns);
+    QHostAddress upstream;
+    quint16 upstreamPort = 0, upstreamID;
+    if(!dnscryptEnabled)
+    {
+        const UpstreamProvider &provider = providers->randomPlain();
+        upstream = provider.address;
+        upstreamPort = provider.port;
+    }
 
-    if(dns.isValid && dns.isResponse)
+    if(!pendingQueries.add(question, clientWaits ? &dns : nullptr, upstream, upstreamPort, upstreamID, prefetch, staleAfterMs))
+    {
+        qDebug() << "Too many queries waiting on upstream already, dropping this one for:" << dns.domainString;
+        return false;
+    }
+    //It goes upstream under our own transaction ID, the client's is kept in the request saved with the pending query
+    *(quint16*)dns.req.data() = qToBigEndian(upstreamID);
+
+    if(dnscryptEnabled)
     {
-        if(!dns.hasIPs && dns.question.qtype == DNS_TYPE_A)
+        qDebug() << "Making encrypted DNS request type:" << dns.question.qtype << "for domain:" << dns.domainString << "request id:" << upstreamID << "datagram:" << dns.req;
+        QString stamp;
+        if(useDedicatedProvider)
         {
-            if(dns.header.rcode == RCODE_NXDOMAIN || dns.header.rcode == RCODE_YXDOMAIN || dns.header.rcode == RCODE_XRRSET)
-            {
-                qDebug() << "For:" << dns.domainString << "NXDOMAIN (Non eXistent domain) or similar response code received, redirecting immediately to custom ip!";
-                dns.ipaddresses.push_back(ipToRespondWith);
-                dns.hasIPs = true;
-                emit lookupDoneSendResponseNow(dns, &serversock);
-            }
+            stamp = dedicatedDNSCrypter;
+            qDebug() << "Using dedicated DNSCrypt provider to resolve DoH/DoTLS provider's host:" << dns.domainString;
         }
         else
+            stamp = providers->randomEncrypted().entry;
+
+        dnscrypt->makeEncryptedRequest(dns, stamp);
+    }
+    else
+    {
+        qDebug() << "Making DNS request type:" << dns.question.qtype << "for domain:" << dns.domainString << "request id:" << upstreamID << "datagram:" << dns.req;
+        clientsock.writeDatagram(dns.req, upstream, upstreamPort);
+    }
+
+    requestLastSentTime = QDateTime::currentDateTime();
+    sendrecvFlag = 0;
+    return true;
+}
+
+void SmallDNSServer::answerStale(DNSInfo &respondTo, DNSInfo &stale)
+{
+    //RFC 8767, an expired answer beats no answer at all, handed out with a short TTL so the client asks again soon
+    if(respondTo.req.size() <= DNS_HEADER_SIZE)
+        return;
+
+    if(stale.question.qtype == DNS_TYPE_A && stale.hasIPs && stale.ipaddresses.size() > 0)
+    {
+        QByteArray response = respondTo.req;
+        morphRequestIntoARecordResponse(response, stale.ipaddresses, respondTo.answeroffset, STALE_ANSWER_TTL);
+        serversock.writeDatagram(response, respondTo.sender, respondTo.senderPort);
+        emit queryRespondedTo(ListEntry(respondTo.domainString, stale.ipaddresses[0]));
+    }
+    else if(stale.res.size() > DNS_HEADER_SIZE && (stale.question.qtype != DNS_TYPE_A || stale.negative))
+    {
+        QByteArray response = stale.res;
+        *(quint16*)response.data() = *(quint16*)respondTo.req.data();
+        rewriteTTLs(response, stale.answeroffset, 0, STALE_ANSWER_TTL);
+        serversock.writeDatagram(response, respondTo.sender, respondTo.senderPort);
+    }
+    else
+        return;
+
+    dnsCache->countStaleAnswer();
+    qDebug() << "Served a stale answer for:" << respondTo.domainString << "type:" << respondTo.question.qtype << "expired at:" << stale.expiry;
+}
+
+bool SmallDNSServer::answerWaitersStale(PendingQueries::Lookup &lookup)
+{
+    DNSInfo stale;
+    if(!serveStale || lookup.waiters.empty() || !dnsCache->peek(lookup.question, stale))
+        return false;
+    if(stale.expiry.secsTo(QDateTime::currentDateTime()) > (qint64)staleMaxAge)
+        return false;
+
+    for(DNSInfo &respondTo : lookup.waiters)
+        answerStale(respondTo, stale);
+    return true;
+}
+
+void SmallDNSServer::parseAndRespond(QByteArray &datagram, DNSInfo &dns, const QHostAddress &upstream, quint16 upstreamPort)
+{
+    parseResponse(datagram, dns);
+    responseLastReceivedTime = QDateTime::currentDateTime();
+    sendrecvFlag = 1;
+
+    if(dns.isValid && dns.isResponse)
+    {
+        //Only responses to what we actually asked get answered and cached, anything else is late, a duplicate, or spoofed
+        QByteArray cacheKey = DNSCache::makeKey(datagram, dns.answeroffset);
+        PendingQueries::Lookup lookup;
+        if(!pendingQueries.take(dns.header.id, upstream, upstreamPort, cacheKey, lookup))
         {
-            emit lookupDoneSendResponseNow(dns, &serversock);
+            qDebug() << "Dropping a response nobody's waiting for, id:" << dns.header.id << "from:" << upstream << upstreamPort << "for domain:" << dns.domainString;
+            return;
         }
+        std::vector<DNSInfo> &waiters = lookup.waiters;
 
-        DNSInfo *cached = getCachedEntry(dns.domainString, dns.question.qtype);
-        if(cached)
+        //Upstream failing on us, if there's an expired answer for this we'd rather keep (and hand out) that,
+        //otherwise the clients get the failure as is, but it isn't cached over anything
+        if(dns.header.rcode == RCODE_SERVFAIL || dns.header.rcode == RCODE_REFUSED)
         {
-            //Update the cached entry
-            dns.expiry = QDateTime::currentDateTime().addSecs(cachedMinutesValid * 60);
-            *cached = dns;
-            qDebug() << "Updated cache of record type:" << dns.question.qtype << "for domain:" << dns.domainString << "with new expiry:" << dns.expiry;
+            if(!answerWaitersStale(lookup))
+            {
+                for(DNSInfo &respondTo : waiters)
+                    sendResponse(respondTo, dns);
+            }
+            return;
         }
-        else
+
+        dns.cachedAt = QDateTime::currentDateTime();
+        dns.expiry = dns.cachedAt.addSecs(cacheLifetime(dns));
+        dns.prefetched = lookup.prefetch;
+
+        if(!dns.hasIPs && dns.question.qtype == DNS_TYPE_A &&
+           (dns.header.rcode == RCODE_NXDOMAIN || dns.header.rcode == RCODE_YXDOMAIN || dns.header.rcode == RCODE_XRRSET))
         {
-            //Or create the cache entry initially
-            dns.expiry = QDateTime::currentDateTime().addSecs(cachedMinutesValid * 60);
-            cachedDNSResponses.push_back(dns);
+            qDebug() << "For:" << dns.domainString << "NXDOMAIN (Non eXistent domain) or similar response code received, redirecting immediately to custom ip!";
+            dns.ipaddresses.push_back(ipToRespondWith);
+            dns.hasIPs = true;
         }
+        for(DNSInfo &respondTo : waiters)
+            sendResponse(respondTo, dns);
+        qDebug() << "Response handled in:" << ((float)(QDateTime::currentMSecsSinceEpoch() - lookup.sentAt) / 1000.0f) << "secs" << "for" << waiters.size() << "waiting queries";
+
+        //Create the cache entry initially, or update the one that's there
+        dnsCache->store(cacheKey, dns);
+        qDebug() << "Cached" << (dns.negative ? "negative" : "") << "record type:" << dns.question.qtype << "for domain:" << dns.domainString << "with expiry:" << dns.expiry;
 
         if(dns.hasIPs && dns.question.qtype == DNS_TYPE_A)
             emit queryRespondedTo(ListEntry(dns.domainString, dns.ipaddresses[0]));
     }
-    responseLastReceivedTime = QDateTime::currentDateTime();
-    sendrecvFlag = 1;
+}
+
+void SmallDNSServer::sendResponse(DNSInfo &respondTo, DNSInfo &dns)
+{
+    if(respondTo.req.size() <= DNS_HEADER_SIZE)
+        return;
+
+    if(dns.question.qtype == DNS_TYPE_A && dns.hasIPs)
+    {
+        //The saved request still has the client's own transaction ID
+        morphRequestIntoARecordResponse(respondTo.req, dns.ipaddresses, dns.answeroffset, honorUpstreamTTL ? cacheLifetime(dns) : respondTo.ttl);
+        serversock.writeDatagram(respondTo.req, respondTo.sender, respondTo.senderPort);
+        qDebug() << "[A RECORD] to:" << respondTo.sender << respondTo.senderPort << "\n" << respondTo.req;
+    }
+    else if(dns.res.size() > DNS_HEADER_SIZE && (dns.question.qtype != DNS_TYPE_A || dns.negative || dns.header.rcode != RCODE_NOERROR))
+    {
+        //Negative answers and failures (for an A too) go back as upstream sent them, rcode and authority SOA intact
+        QByteArray response = dns.res;
+        *(quint16*)response.data() = *(quint16*)respondTo.req.data(); //Put the client's transaction ID back in place of ours
+        if(honorUpstreamTTL)
+            rewriteTTLs(response, dns.answeroffset, 0); //Fresh, but still kept within the same bounds the cache uses
+        serversock.writeDatagram(response, respondTo.sender, respondTo.senderPort);
+        qDebug() << "Responding to a type:" << dns.question.qtype << "\n" << response;
+    }
+}
+
+void SmallDNSServer::expirePendingQueries()
+{
+    //Lookups past the stale deadline we gave them get the expired answer. If it's gone by now (evicted, cleared or too old)
+    //their waiters go back on the lookup, which is still in flight, and get its response after all
+    std::vector<PendingQueries::Lookup> overdue, timedOut;
+    pendingQueries.takeOverdue(overdue);
+    for(PendingQueries::Lookup &lookup : overdue)
+    {
+        if(!answerWaitersStale(lookup))
+            pendingQueries.giveBack(lookup);
+    }
+
+    //Then ones upstream never answered at all, whoever's waiting on them gets the expired answer if there is one
+    pendingQueries.expire(timedOut);
+    for(PendingQueries::Lookup &lookup : timedOut)
+        answerWaitersStale(lookup);
 }
 
 void SmallDNSServer::decryptedLookupDoneSendResponseNow(QByteArray decryptedResponse, DNSInfo &dns)
 {
+    //Encrypted lookups come back through their own socket, so they're waiting under a null upstream endpoint
     parseAndRespond(decryptedResponse, dns);
 }
 
@@ -425,48 +682,16 @@ void SmallDNSServer::processLookups()
     {
         datagram.resize(clientsock.pendingDatagramSize());
         clientsock.readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
-        parseAndRespond(datagram, dns);
+        parseAndRespond(datagram, dns, sender, senderPort);
     }
 }
 
-ListEntry* SmallDNSServer::getListEntry(const std::string &tame, int listType)
+const ListEntry* SmallDNSServer::getListEntry(const QString &domain, int listType)
 {
     if(listType == TYPE_WHITELIST)
-    {
-        for(ListEntry &whiteListed : whitelist)
-        {
-            std::string wild = whiteListed.hostname.toUtf8().data();
-            if(GeneralTextCompare((char*)tame.c_str(), (char*)wild.c_str()))
-            {
-                return &whiteListed;
-            }
-        }
-    }
+        return whitelistMatcher.match(domain);
     else if(listType == TYPE_BLACKLIST)
-    {
-        for(ListEntry &blackListed : blacklist)
-        {
-            std::string wild = blackListed.hostname.toUtf8().data();
-            if(GeneralTextCompare((char*)tame.c_str(), (char*)wild.c_str()))
-            {
-                return &blackListed;
-            }
-        }
-    }
-    return nullptr;
-}
-
-DNSInfo* SmallDNSServer::getCachedEntry(const QString &byDomain, quint16 andType)
-{
-    size_t cachedSize = cachedDNSResponses.size();
-    for(size_t i = 0; i < cachedSize; i++)
-    {
-        DNSInfo *pDNS = &cachedDNSResponses[i];
-
-        if(pDNS->domainString == byDomain && pDNS->question.qtype == andType)
-            return pDNS;
-    }
-
+        return blacklistMatcher.match(domain);
     return nullptr;
 }
 
@@ -567,48 +792,139 @@ QString SmallDNSServer::getDomainString(const QByteArray &dnsmessage, DNSInfo &d
     return fullname;
 }
 
+int SmallDNSServer::skipName(const QByteArray &dnsmessage, int offset)
+{
+    //Steps over a (possibly compressed) name, returns where whatever follows it starts or -1 if it runs off the end
+    const quint8 *msg = (const quint8*)dnsmessage.constData();
+    int size = dnsmessage.size();
+    while(offset < size)
+    {
+        quint8 len = msg[offset];
+        if(len == 0)
+            return offset + 1;
+        if((len & 0xc0) == 0xc0) //A pointer always ends the name
+            return (offset + 2 <= size) ? offset + 2 : -1;
+        if(len > 63)
+            return -1;
+        offset += len + 1;
+    }
+    return -1;
+}
+
+quint32 SmallDNSServer::clampTTL(quint32 ttl)
+{
+    if(ttl < minCacheTTL) return minCacheTTL;
+    if(maxCacheTTL >= minCacheTTL && ttl > maxCacheTTL) return maxCacheTTL;
+    return ttl;
+}
+
+quint32 SmallDNSServer::cacheLifetime(const DNSInfo &dns)
+{
+    if(!honorUpstreamTTL)
+        return cachedMinutesValid * 60;
+
+    //RFC 2308, negative answers live as long as their SOA says (capped lower than positive ones),
+    //without an SOA there's nothing to go by so they're only kept for the minimum
+    if(dns.negative)
+        return (dns.negativeTTL < 0) ? minCacheTTL : qMin(clampTTL((quint32)dns.negativeTTL), qMax(maxNegativeCacheTTL, minCacheTTL));
+
+    if(dns.minTTL < 0)
+        return cachedMinutesValid * 60;
+    return clampTTL((quint32)dns.minTTL);
+}
+
+void SmallDNSServer::rewriteTTLs(QByteArray &dnsresponse, quint32 answeroffset, qint64 age, qint32 fixedTTL)
+{
+    if(dnsresponse.size() < DNS_HEADER_SIZE) return;
+
+    quint8 *msg = (quint8*)dnsresponse.data();
+    int size = dnsresponse.size(), offset = answeroffset;
+    int records = qFromBigEndian<quint16>(msg + 6) + qFromBigEndian<quint16>(msg + 8) + qFromBigEndian<quint16>(msg + 10);
+
+    for(int i = 0; i < records; i++)
+    {
+        offset = skipName(dnsresponse, offset);
+        if(offset < 0 || offset + 10 > size) return;
+
+        quint16 type = qFromBigEndian<quint16>(msg + offset);
+        if(type != DNS_TYPE_OPT) //The OPT pseudo record's "TTL" is really EDNS flags
+        {
+            quint32 ttl = qFromBigEndian<quint32>(msg + offset + 4);
+            if(ttl > 0x7fffffff) ttl = 0;
+            qint64 left = (fixedTTL >= 0) ? fixedTTL : (qint64)clampTTL(ttl) - age;
+            qToBigEndian((quint32)qMax(left, (qint64)0), msg + offset + 4);
+        }
+        offset += 10 + qFromBigEndian<quint16>(msg + offset + 8);
+    }
+}
+
 void SmallDNSServer::getHostAddresses(const QByteArray &dnsresponse, DNSInfo &dns)
 {
-    dns.hasIPs = false;
-    if(!dns.isResponse || dns.question.qtype != DNS_TYPE_A) return; //if not a response and containing an A record, then there's no IPs here to grab...
+    dns.hasIPs = dns.negative = false;
+    dns.ipaddresses.clear(); //The same DNSInfo gets reused for every datagram read in a row
+    dns.minTTL = dns.negativeTTL = -1;
+    if(!dns.isResponse) return;
 
-    ANSWER answer;
-    const char *ptr = &dnsresponse.data()[dns.answeroffset];
-    const char *ptr_end = &dnsresponse.data()[dnsresponse.size()];
+    const quint8 *msg = (const quint8*)dnsresponse.constData();
+    int size = dnsresponse.size(), offset = dns.answeroffset;
 
-    for(quint16 i = 0; i < dns.header.ans_count; i++)
+    quint16 answers = 0;
+    for(; answers < dns.header.ans_count; answers++)
     {
-        if((ptr + DNS_HEADER_SIZE) >= ptr_end)
+        //Answer names are usually a pointer back to the question, but CNAME chains and uncompressed names happen too
+        offset = skipName(dnsresponse, offset);
+        if(offset < 0 || offset + 10 > size)
             break;
 
-        answer.name = qFromBigEndian(*(quint16*)ptr);
-        ptr += 2;
-        answer.type = qFromBigEndian(*(quint16*)ptr);
-        ptr += 2;
-        answer.rclass = qFromBigEndian(*(quint16*)ptr);
-        ptr += 2;
-        answer.ttl = qFromBigEndian(*(quint32*)ptr);
-        ptr += 4;
-        answer.rdlength = qFromBigEndian(*(quint16*)ptr);
-        ptr += 2;
-
-        //qDebug() << "Interpreted answer name:" << answer.name << "type:" << answer.type << "rclass:" << answer.rclass << "ttl:" << answer.ttl << "rdlength:" << answer.rdlength;
-
-        quint32 ip;
-        if(answer.type == DNS_TYPE_A && answer.rdlength == 4) //if it's an A record which should be 4 bytes
-        {
-            memcpy(&ip, ptr, 4);
-            ip = qFromBigEndian(ip);
+        quint16 type = qFromBigEndian<quint16>(msg + offset);
+        quint32 ttl = qFromBigEndian<quint32>(msg + offset + 4);
+        quint16 rdlength = qFromBigEndian<quint16>(msg + offset + 8);
+        offset += 10;
+        if(offset + rdlength > size)
+            break;
+
+        if(ttl > 0x7fffffff) ttl = 0; //RFC 2181, a TTL with the top bit set counts as zero
+        if(dns.minTTL < 0 || ttl < (quint32)dns.minTTL)
+            dns.minTTL = (qint32)ttl;
 
-            qDebug() << "Got IP:" << QHostAddress(ip).toString() << "for domain:" << dns.domainString;
+        //if it's an A record which should be 4 bytes, and we were asking for A records
+        if(dns.question.qtype == DNS_TYPE_A && type == DNS_TYPE_A && rdlength == 4)
+        {
+            quint32 ip = qFromBigEndian<quint32>(msg + offset);
+            qDebug() << "Got IP:" << QHostAddress(ip).toString() << "for domain:" << dns.domainString << "ttl:" << ttl;
             dns.ipaddresses.push_back(ip);
             dns.hasIPs = true;
         }
+        offset += rdlength;
+    }
 
-        if((ptr + answer.rdlength) < ptr_end)
-            ptr += answer.rdlength;
-        else
+    dns.negative = (dns.header.rcode == RCODE_NXDOMAIN || (dns.header.rcode == RCODE_NOERROR && dns.header.ans_count == 0));
+    if(!dns.negative || answers != dns.header.ans_count)
+        return;
+
+    //The authority section of a negative answer should carry the zone's SOA, its TTL and MINIMUM (the last rdata field) bound how long we may cache it
+    for(quint16 i = 0; i < dns.header.auth_count; i++)
+    {
+        offset = skipName(dnsresponse, offset);
+        if(offset < 0 || offset + 10 > size)
+            break;
+
+        quint16 type = qFromBigEndian<quint16>(msg + offset);
+        quint32 ttl = qFromBigEndian<quint32>(msg + offset + 4);
+        quint16 rdlength = qFromBigEndian<quint16>(msg + offset + 8);
+        offset += 10;
+        if(offset + rdlength > size)
             break;
+
+        if(type == DNS_TYPE_SOA && rdlength >= 22) //Two names (at least a byte each) and five 32 bit fields
+        {
+            quint32 minimum = qFromBigEndian<quint32>(msg + offset + rdlength - 4);
+            if(ttl > 0x7fffffff) ttl = 0;
+            if(minimum > 0x7fffffff) minimum = 0;
+            dns.negativeTTL = (qint32)qMin(ttl, minimum);
+            break;
+        }
+        offset += rdlength;
     }
 }
 
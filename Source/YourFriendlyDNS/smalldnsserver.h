@@ -35,7 +35,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <QProcess>
 #include "androidsuop.h"
 #include "initialresponse.h"
+#include "dnscache.h"
+#include "pendingqueries.h"
+#include "listmatcher.h"
 #include "dnscrypt.h" //Including our DNSCrypt class and helpers, giving us DNSCrypt protocol version 1,2,3 support!
+#include "providerregistry.h"
 
 /* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
 Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
@@ -64,65 +68,95 @@ You should have received a copy of the GNU General Public License along
 with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
 
-/* GeneralTextCompare By Kirk J. Krauss, August 26, 2008
+#define STALE_ANSWER_TTL 30
 
-A simple wildcard text-matching algorithm in a single while loop */
-bool GeneralTextCompare(
-        char * pTameText,             // A string without wildcards
-        char * pWildText,             // A (potentially) corresponding string with wildcards
-        bool bCaseSensitive = false,  // By default, match on 'X' vs 'x'
-        char cAltTerminator = '\0'    // For function names, for example, you can stop at the first '('
-);
+//Everything a worker takes from the primary server. It's copied on the primary's own thread whenever settings are published
+//and never changed after, so workers only ever read this and never the primary server itself.
+struct ServerSettings
+{
+    bool whitelistmode, blockmode_returnlocalhost, initialMode, autoTTL, dnscryptEnabled, honorUpstreamTTL, prefetchEnabled, serveStale, newKeyPerRequest;
+    double prefetchFraction;
+    Q_IPV6ADDR ipv6ToRespondWith;
+    quint32 ipToRespondWith, cachedMinutesValid, dnsTTL, minCacheTTL, maxCacheTTL, maxNegativeCacheTTL, cacheMemoryMB, prefetchMinHits, staleAnswerDelayMs, staleMaxAge;
+    QString dedicatedDNSCrypter;
+    QVector<ListEntry> whitelist, blacklist;
+    ListMatcher whitelistMatcher, blacklistMatcher;
+    QVector<QString> realdns;
+    QSharedPointer<const ProviderRegistry> providers;
+    QVector<quint32> listeningIPs;
+    QVector<Q_IPV6ADDR> listeningIPv6s;
+};
+typedef QSharedPointer<const ServerSettings> ServerSettingsSnapshot;
 
 class SmallDNSServer : public QObject
 {
     Q_OBJECT
 public:
-    explicit SmallDNSServer(QObject *parent = nullptr);
-    bool startServer(QHostAddress address = QHostAddress::AnyIPv4, quint16 port = 53, bool reuse = false);
+    explicit SmallDNSServer(SharedDNSCache *sharedCache = nullptr, QObject *parent = nullptr);
+    ~SmallDNSServer();
+    bool startServer(QHostAddress address = QHostAddress::AnyIPv4, quint16 port = 53, bool reuse = false, bool reusePort = false);
+    static bool reusePortBalancesLoad();
+    ServerSettingsSnapshot publishedSettings() const { return lastPublished; } //Only from the primary's own thread
     QString getDomainString(const QByteArray &dnsmessage, DNSInfo &dns);
-    void determineDoHDoTLSProviders();
 
-    bool whitelistmode, blockmode_returnlocalhost, initialMode, autoTTL, dnscryptEnabled, sendrecvFlag;
+    bool whitelistmode, blockmode_returnlocalhost, initialMode, autoTTL, dnscryptEnabled, sendrecvFlag, honorUpstreamTTL, prefetchEnabled, serveStale;
+    double prefetchFraction;
     QDateTime requestLastSentTime, responseLastReceivedTime, timeoutInferencePeriod, timeoutEnd;
     Q_IPV6ADDR ipv6ToRespondWith;
-    quint32 ipToRespondWith, cachedMinutesValid, dnsTTL, inTimeout;
-    quint64 numSentRequests, numReceivedResponses;
+    quint32 ipToRespondWith, cachedMinutesValid, dnsTTL, inTimeout, minCacheTTL, maxCacheTTL, maxNegativeCacheTTL, cacheMemoryMB, prefetchMinHits, staleAnswerDelayMs, staleMaxAge;
+    quint64 numSentRequests, numReceivedResponses, numCoalescedQueries;
     QString dedicatedDNSCrypter;
     QVector<ListEntry> whitelist,blacklist;
-    QVector<QString> realdns, v2and3Providers;
+    ListMatcher whitelistMatcher, blacklistMatcher;
+    QVector<QString> realdns;
+    QSharedPointer<const ProviderRegistry> providers; //Parsed from realdns whenever settings are published
     QVector<quint32> listeningIPs;
     QVector<Q_IPV6ADDR> listeningIPv6s;
-    std::vector<DNSInfo> cachedDNSResponses;
+    SharedDNSCache *dnsCache;
     QUdpSocket serversock;
     DNSCrypt *dnscrypt;
 
 private:
-    ListEntry* getListEntry(const std::string &tame, int listType);
-    DNSInfo* getCachedEntry(const QString &byDomain, quint16 andType);
-    void parseAndRespond(QByteArray &datagram, DNSInfo &dns);
+    bool bindReusePort(const QHostAddress &address, quint16 port);
+    const ListEntry* getListEntry(const QString &domain, int listType);
+    void parseAndRespond(QByteArray &datagram, DNSInfo &dns, const QHostAddress &upstream = QHostAddress(), quint16 upstreamPort = 0);
+    void sendResponse(DNSInfo &respondTo, DNSInfo &dns);
+    bool forwardQuery(DNSInfo &dns, const QByteArray &question, bool clientWaits, bool useDedicatedProvider, bool prefetch = false, qint64 staleAfterMs = -1);
+    void answerStale(DNSInfo &respondTo, DNSInfo &stale);
+    bool answerWaitersStale(PendingQueries::Lookup &lookup);
     bool interpretHeader(const QByteArray &dnsmessage, DNSInfo &dns);
     void parseRequest(const QByteArray &dnsrequest, DNSInfo &dns);
     void parseResponse(const QByteArray &dnsresponse, DNSInfo &dns);
     void getHostAddresses(const QByteArray &dnsresponse, DNSInfo &dns);
-    QString selectRandomDNSServer();
-    QString selectRandomDNSCryptServer();
+    static int skipName(const QByteArray &dnsmessage, int offset);
+    quint32 clampTTL(quint32 ttl);
+    quint32 cacheLifetime(const DNSInfo &dns);
+    void rewriteTTLs(QByteArray &dnsresponse, quint32 answeroffset, qint64 age, qint32 fixedTTL = -1);
+    void rebuildProviders();
+    void closeUnusedSessions();
     bool weDoStillHaveAConnection();
     QUdpSocket clientsock;
+    PendingQueries pendingQueries;
+    QTimer pendingExpiryTimer;
+    bool ownsCache;
+    ServerSettingsSnapshot lastPublished;
 
 signals:
     void queryRespondedTo(ListEntry responded);
-    void lookupDoneSendResponseNow(DNSInfo &dns, QUdpSocket *serversocket);
-    void deleteObjectsTheresNoResponseFor();
+    void settingsPublished(ServerSettingsSnapshot settings);
 
 public slots:
     void clearDNSCache();
+    void compileLists();
+    void publishSettings();
+    void adoptSettings(ServerSettingsSnapshot settings);
     void deleteEntriesFromCache(std::vector<ListEntry> entries);
     void decryptedLookupDoneSendResponseNow(QByteArray decryptedResponse, DNSInfo &dns);
 
 private slots:
     void processDNSRequests();
     void processLookups();
+    void expirePendingQueries();
 };
 
 #endif // SMALLDNSSERVER_H
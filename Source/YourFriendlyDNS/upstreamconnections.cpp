@@ -0,0 +1,651 @@
+#include "upstreamconnections.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+static QAtomicInteger<quint64> dohQueryCount, dohHandshakeCount, dohHttp2Count, dotQueryCount, dotHandshakeCount, tlsFullCount, tlsTicketCount;
+
+struct CachedTicket
+{
+    QByteArray ticket;
+    qint64 expiresAt;
+};
+static QMutex ticketMutex;
+static QHash<QString, CachedTicket> ticketsByHostname;
+
+UpstreamStats UpstreamStats::current()
+{
+    UpstreamStats stats;
+    stats.dohQueries = dohQueryCount.loadAcquire();
+    stats.dohHandshakes = dohHandshakeCount.loadAcquire();
+    stats.dohHttp2Connections = dohHttp2Count.loadAcquire();
+    stats.dotQueries = dotQueryCount.loadAcquire();
+    stats.dotHandshakes = dotHandshakeCount.loadAcquire();
+    stats.tlsFullHandshakes = tlsFullCount.loadAcquire();
+    stats.tlsTicketHandshakes = tlsTicketCount.loadAcquire();
+    return stats;
+}
+
+void UpstreamStats::countDoHQuery()
+{
+    dohQueryCount.fetchAndAddRelaxed(1);
+}
+
+void UpstreamStats::countDoHHandshake()
+{
+    dohHandshakeCount.fetchAndAddRelaxed(1);
+}
+
+void UpstreamStats::countDoHHttp2Connection()
+{
+    dohHttp2Count.fetchAndAddRelaxed(1);
+}
+
+void UpstreamStats::countDoTQuery()
+{
+    dotQueryCount.fetchAndAddRelaxed(1);
+}
+
+void UpstreamStats::countDoTHandshake()
+{
+    dotHandshakeCount.fetchAndAddRelaxed(1);
+}
+
+void UpstreamStats::countTlsHandshake(bool offeredTicket)
+{
+    if(offeredTicket)
+        tlsTicketCount.fetchAndAddRelaxed(1);
+    else
+        tlsFullCount.fetchAndAddRelaxed(1);
+}
+
+bool TlsSessionCache::offer(QSslConfiguration &config, const QString &hostname)
+{
+    config.setSslOption(QSsl::SslOptionDisableSessionTickets, false);
+    config.setSslOption(QSsl::SslOptionDisableSessionPersistence, false); //Otherwise there's no ticket to read back out after the handshake
+
+    QMutexLocker locker(&ticketMutex);
+    auto i = ticketsByHostname.find(hostname);
+    if(i == ticketsByHostname.end())
+    {
+        config.setSessionTicket(QByteArray());
+        return false;
+    }
+    if(QDateTime::currentMSecsSinceEpoch() >= i->expiresAt)
+    {
+        ticketsByHostname.erase(i);
+        config.setSessionTicket(QByteArray());
+        return false;
+    }
+    config.setSessionTicket(i->ticket);
+    return true;
+}
+
+void TlsSessionCache::remember(const QSslConfiguration &config, const QString &hostname)
+{
+    QByteArray ticket = config.sessionTicket();
+    if(ticket.isEmpty())
+        return;
+
+    int lifetime = config.sessionTicketLifeTimeHint();
+    CachedTicket cached;
+    cached.ticket = ticket;
+    cached.expiresAt = QDateTime::currentMSecsSinceEpoch() + (qint64)(lifetime > 0 ? lifetime : TLS_TICKET_DEFAULT_LIFETIME_SECS) * 1000;
+    QMutexLocker locker(&ticketMutex);
+    ticketsByHostname.insert(hostname, cached);
+}
+
+DoHConnection::DoHConnection(QString hostname, QString path, QHostAddress server, quint16 port, QString userAgent, QObject *parent)
+{
+    Q_UNUSED(parent);
+    this->hostname = hostname;
+    this->path = path;
+    this->userAgent = userAgent;
+    this->server = server;
+    this->port = port;
+    pipelining = pipeliningFailed = http2Failed = offeredTicket = false;
+    pipelinedAnswers = 0;
+    http2 = nullptr;
+    parsed = 0;
+
+    requestHead = QString("POST %1 HTTP/1.1\r\nHost: %2\r\nUser-Agent: %3\r\nAccept: application/dns-message\r\nContent-Type: application/dns-message\r\nContent-Length: ")
+            .arg(path).arg(hostname).arg(userAgent).toUtf8();
+
+    tls.setPeerVerifyName(hostname);
+    connect(&tls, &QSslSocket::connected, this, &DoHConnection::startEncryption);
+    connect(&tls, &QSslSocket::encrypted, this, &DoHConnection::encrypted);
+    connect(&tls, &QSslSocket::readyRead, this, &DoHConnection::readResponses);
+    connect(&tls, &QSslSocket::disconnected, this, &DoHConnection::disconnected);
+    connect(&tls, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &DoHConnection::socketError);
+    connect(&tls, &QSslSocket::peerVerifyError, this, &DoHConnection::verifyError);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DoHConnection::checkTimeouts);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    //TLS 1.3 tickets only come after the handshake's done
+    connect(&tls, &QSslSocket::newSessionTicketReceived, this, &DoHConnection::sessionTicketReceived);
+#endif
+}
+
+DoHConnection::~DoHConnection()
+{
+    delete http2;
+}
+
+int DoHConnection::maxInFlight() const
+{
+    if(http2)
+        return http2->maxStreams();
+    return (pipelining && !pipeliningFailed) ? DOH_MAX_PIPELINE : 1;
+}
+
+void DoHConnection::query(const DNSInfo &dns)
+{
+    Request request;
+    request.dns = dns;
+    request.sentAt = 0;
+    request.attempts = 0;
+    request.pipelined = false;
+    waiting.push_back(request);
+    UpstreamStats::countDoHQuery();
+    flush();
+}
+
+void DoHConnection::connectNow()
+{
+    received.clear();
+    parser.reset();
+    parsed = 0;
+    pipelining = false;
+    pipelinedAnswers = 0;
+    delete http2;
+    http2 = nullptr;
+
+    QSslConfiguration config = tls.sslConfiguration();
+    if(http2Failed)
+        config.setAllowedNextProtocols(QList<QByteArray>() << QSslConfiguration::NextProtocolHttp1_1);
+    else
+        config.setAllowedNextProtocols(QList<QByteArray>() << QSslConfiguration::ALPNProtocolHTTP2 << QSslConfiguration::NextProtocolHttp1_1);
+    offeredTicket = TlsSessionCache::offer(config, hostname);
+    tls.setSslConfiguration(config);
+
+    //Stamps without an address use the one bootstrapped ahead of time, only before that's in does it connect by hostname
+    //(resolved by the system, which is this server itself if system dns is set to use it)
+    connectedAddress = server.isNull() ? BootstrapResolver::instance()->addressFor(hostname) : server;
+    if(connectedAddress.isNull())
+        tls.connectToHostEncrypted(hostname, port);
+    else
+        tls.connectToHost(connectedAddress, port);
+}
+
+void DoHConnection::startEncryption()
+{
+    //The peer verify name is still the hostname, so the certificate's checked against it (and it goes out as SNI)
+    if(!connectedAddress.isNull())
+        tls.startClientEncryption();
+}
+
+void DoHConnection::encrypted()
+{
+    qDebug() << "DoH connection up to:" << hostname << tls.peerAddress() << "port:" << tls.peerPort() << "offered session ticket:" << offeredTicket;
+    UpstreamStats::countDoHHandshake();
+    UpstreamStats::countTlsHandshake(offeredTicket);
+    TlsSessionCache::remember(tls.sslConfiguration(), hostname);
+    if(tls.sslConfiguration().nextNegotiatedProtocol() == QSslConfiguration::ALPNProtocolHTTP2)
+    {
+        qDebug() << "DoH server:" << hostname << "speaks HTTP/2";
+        http2 = new Http2Client(hostname.toUtf8(), path.toUtf8(), userAgent.toUtf8());
+        tls.write(http2->preface());
+        UpstreamStats::countDoHHttp2Connection();
+    }
+    flush();
+}
+
+void DoHConnection::flush()
+{
+    if(waiting.empty())
+        return;
+    if(tls.state() == QAbstractSocket::UnconnectedState)
+    {
+        connectNow();
+        return;
+    }
+    if(!tls.isEncrypted())
+        return; //Goes out once it is
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if(http2)
+    {
+        //Nothing goes until the server's SETTINGS are in, then as many streams as it allows
+        QByteArray out;
+        while(!waiting.empty() && http2->canOpenStream(waiting.front().dns.req.size()))
+        {
+            Request request = waiting.front();
+            waiting.pop_front();
+            request.sentAt = now;
+            streams.insert(http2->request(request.dns.req, out), request);
+        }
+        if(!out.isEmpty())
+            tls.write(out);
+        if(http2->isGoingAway() && streams.isEmpty())
+            tls.disconnectFromHost(); //Whatever's waiting goes out on a new connection
+    }
+    while(!http2 && !waiting.empty() && (int)inFlight.size() < maxInFlight())
+    {
+        Request request = waiting.front();
+        waiting.pop_front();
+
+        QByteArray http = requestHead;
+        http += QByteArray::number(request.dns.req.size());
+        http += "\r\n\r\n";
+        http += request.dns.req;
+        tls.write(http);
+        qDebug() << "Sent DoH request:" << http;
+
+        request.sentAt = now;
+        request.pipelined = !inFlight.empty();
+        inFlight.push_back(request);
+    }
+    if(!timeoutTimer.isActive())
+        timeoutTimer.start(1000);
+}
+
+bool DoHConnection::readResponse()
+{
+    //One complete response off the front of what's been received, false when it isn't all here yet
+    HttpResponseParser::Result result = parser.parse(received, parsed);
+    if(result == HttpResponseParser::NEED_MORE)
+        return false;
+    if(result == HttpResponseParser::MALFORMED)
+    {
+        qDebug() << "Malformed DoH response from:" << hostname << "closing the connection";
+        inFlight.clear();
+        tls.abort();
+        return false;
+    }
+
+    received.remove(0, parsed);
+    parsed = 0;
+    respond(parser.status, parser.body);
+    bool closing = parser.closing;
+    parser.reset();
+    if(closing)
+    {
+        tls.disconnectFromHost();
+        return false;
+    }
+    pipelining = true; //It answered and kept the connection open, it'll take several at a time now
+    return true;
+}
+
+void DoHConnection::respond(int status, const QByteArray &body)
+{
+    if(inFlight.empty())
+    {
+        qDebug() << "DoH response nobody asked for from:" << hostname;
+        return;
+    }
+
+    Request request = inFlight.front();
+    inFlight.pop_front();
+    if(request.pipelined)
+        pipelinedAnswers++;
+    if(status == 200 && body.size() > 0)
+    {
+        qDebug() << "Received DoH response:" << body;
+        emit decryptedLookupDoneSendResponseNow(body, request.dns);
+    }
+    else
+        qDebug() << "DoH request failed with status:" << status << "from:" << hostname;
+}
+
+void DoHConnection::readHttp2()
+{
+    QByteArray out;
+    std::vector<Http2Client::Response> done;
+    bool ok = http2->receive(tls.readAll(), out, done);
+    if(!out.isEmpty())
+        tls.write(out);
+
+    for(Http2Client::Response &response : done)
+    {
+        auto stream = streams.find(response.streamId);
+        if(stream == streams.end())
+            continue;
+        Request request = stream.value();
+        streams.erase(stream);
+
+        if(response.retry)
+        {
+            if(request.attempts++ == 0)
+                waiting.push_front(request);
+        }
+        else if(!response.failed && response.status == 200 && response.body.size() > 0)
+        {
+            qDebug() << "Received DoH response:" << response.body;
+            emit decryptedLookupDoneSendResponseNow(response.body, request.dns);
+        }
+        else
+            qDebug() << "DoH request failed with status:" << response.status << "from:" << hostname;
+    }
+
+    if(!ok)
+    {
+        qDebug() << "HTTP/2 protocol error from:" << hostname << "falling back to HTTP/1.1";
+        http2Failed = true;
+        tls.abort();
+    }
+}
+
+void DoHConnection::readResponses()
+{
+    if(http2)
+        readHttp2();
+    else
+    {
+        received += tls.readAll();
+        while(readResponse());
+    }
+    flush();
+}
+
+void DoHConnection::disconnected()
+{
+    //A response without a length runs until the connection closes, so it's done now
+    if(!http2 && parser.finishAtClose(received, parsed))
+        respond(parser.status, parser.body);
+    parser.reset();
+
+    //If more than one was written ahead and none of the ones behind another got answered, this server doesn't handle pipelining,
+    //so that's it for it here. Once some have been, it's just the server ending the connection (Connection: close, idle timeout)
+    if(inFlight.size() > 1 && pipelinedAnswers == 0)
+        pipeliningFailed = true;
+    pipelining = false;
+    parsed = 0;
+    received.clear();
+    delete http2;
+    http2 = nullptr;
+
+    //Written but not answered, most likely the server closed the idle connection as they went out, they get one more try
+    while(!inFlight.empty())
+    {
+        Request request = inFlight.back();
+        inFlight.pop_back();
+        if(request.attempts++ == 0)
+            waiting.push_front(request);
+    }
+    for(Request &request : streams)
+    {
+        if(request.attempts++ == 0)
+            waiting.push_front(request);
+    }
+    streams.clear();
+    if(waiting.empty())
+        timeoutTimer.stop();
+    else
+        QTimer::singleShot(0, this, &DoHConnection::flush);
+}
+
+void DoHConnection::socketError(QAbstractSocket::SocketError error)
+{
+    qDebug() << "DoH connection to:" << hostname << "error:" << error << tls.errorString();
+    //Couldn't even get connected, nothing waiting on it is going anywhere
+    if(!tls.isEncrypted() && inFlight.empty() && streams.isEmpty())
+    {
+        waiting.clear();
+        timeoutTimer.stop();
+    }
+}
+
+void DoHConnection::verifyError(const QSslError &error)
+{
+    qDebug() << "TLS Error:" << error.errorString();
+}
+
+void DoHConnection::sessionTicketReceived()
+{
+    TlsSessionCache::remember(tls.sslConfiguration(), hostname);
+}
+
+void DoHConnection::checkTimeouts()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 oldest = inFlight.empty() ? now : inFlight.front().sentAt;
+    for(const Request &request : streams)
+        oldest = qMin(oldest, request.sentAt);
+    if(now - oldest > DOH_QUERY_TIMEOUT_MS)
+    {
+        qDebug() << "DoH server:" << hostname << "stopped answering, dropping the connection";
+        inFlight.clear(); //Clients are answered by their own timeout (or stale data) instead
+        streams.clear();
+        tls.abort();
+    }
+    if(inFlight.empty() && streams.isEmpty() && waiting.empty())
+        timeoutTimer.stop();
+}
+
+DoTConnection::DoTConnection(QString hostname, QHostAddress server, quint16 port, QObject *parent)
+{
+    Q_UNUSED(parent);
+    this->hostname = hostname;
+    this->server = server;
+    this->port = port;
+    wireId = (quint16)(QDateTime::currentMSecsSinceEpoch() & 0xffff);
+    offeredTicket = false;
+
+    tls.setPeerVerifyName(hostname);
+    connect(&tls, &QSslSocket::connected, this, &DoTConnection::startEncryption);
+    connect(&tls, &QSslSocket::encrypted, this, &DoTConnection::encrypted);
+    connect(&tls, &QSslSocket::readyRead, this, &DoTConnection::readResponses);
+    connect(&tls, &QSslSocket::disconnected, this, &DoTConnection::disconnected);
+    connect(&tls, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &DoTConnection::socketError);
+    connect(&tls, &QSslSocket::peerVerifyError, this, &DoTConnection::verifyError);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DoTConnection::checkTimeouts);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    connect(&tls, &QSslSocket::newSessionTicketReceived, this, &DoTConnection::sessionTicketReceived);
+#endif
+}
+
+void DoTConnection::query(const DNSInfo &dns)
+{
+    if(dns.req.size() < DNS_HEADER_SIZE)
+        return;
+
+    Request request;
+    request.dns = dns;
+    request.sentAt = 0;
+    request.attempts = 0;
+    waiting.push_back(request);
+    UpstreamStats::countDoTQuery();
+    flush();
+}
+
+void DoTConnection::connectNow()
+{
+    received.clear();
+    QSslConfiguration config = tls.sslConfiguration();
+    offeredTicket = TlsSessionCache::offer(config, hostname);
+    tls.setSslConfiguration(config);
+
+    //Stamps without an address use the one bootstrapped ahead of time, only before that's in does it connect by hostname
+    //(resolved by the system, which is this server itself if system dns is set to use it)
+    connectedAddress = server.isNull() ? BootstrapResolver::instance()->addressFor(hostname) : server;
+    if(connectedAddress.isNull())
+        tls.connectToHostEncrypted(hostname, port);
+    else
+        tls.connectToHost(connectedAddress, port);
+}
+
+void DoTConnection::startEncryption()
+{
+    if(!connectedAddress.isNull())
+        tls.startClientEncryption();
+}
+
+void DoTConnection::encrypted()
+{
+    qDebug() << "DoT connection up to:" << hostname << tls.peerAddress() << "port:" << tls.peerPort() << "offered session ticket:" << offeredTicket;
+    UpstreamStats::countDoTHandshake();
+    UpstreamStats::countTlsHandshake(offeredTicket);
+    TlsSessionCache::remember(tls.sslConfiguration(), hostname);
+    flush();
+}
+
+quint16 DoTConnection::nextWireId()
+{
+    //Different clients can easily use the same id at the same time, so what goes out is unique on this connection instead
+    do
+        wireId++;
+    while(inFlight.contains(wireId));
+    return wireId;
+}
+
+void DoTConnection::flush()
+{
+    if(waiting.empty())
+        return;
+    if(tls.state() == QAbstractSocket::UnconnectedState)
+    {
+        connectNow();
+        return;
+    }
+    if(!tls.isEncrypted())
+        return; //Goes out once it is
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QByteArray out;
+    while(!waiting.empty() && inFlight.size() < DOT_MAX_IN_FLIGHT)
+    {
+        Request request = waiting.front();
+        waiting.pop_front();
+
+        quint16 id = nextWireId();
+        quint16 length = qToBigEndian((quint16)request.dns.req.size()), idOnWire = qToBigEndian(id);
+        out.append((const char*)&length, 2);
+        out.append((const char*)&idOnWire, 2);
+        out.append(request.dns.req.constData() + 2, request.dns.req.size() - 2);
+
+        request.sentAt = now;
+        inFlight.insert(id, request);
+    }
+    //All of them in as few TLS records as possible
+    tls.write(out);
+    qDebug() << "Sent DoTLS requests:" << out;
+    if(!timeoutTimer.isActive())
+        timeoutTimer.start(1000);
+}
+
+void DoTConnection::readResponses()
+{
+    received += tls.readAll();
+    int pos = 0;
+    while(received.size() - pos >= 2)
+    {
+        quint16 length = qFromBigEndian<quint16>((const uchar*)received.constData() + pos);
+        if(received.size() - pos - 2 < length)
+            break; //The rest of it's in a record still on the way
+
+        QByteArray response = received.mid(pos + 2, length);
+        pos += 2 + length;
+        if(response.size() < DNS_HEADER_SIZE)
+            continue;
+
+        quint16 id = qFromBigEndian<quint16>((const uchar*)response.constData());
+        auto i = inFlight.find(id);
+        if(i == inFlight.end())
+        {
+            qDebug() << "DoT response nobody asked for from:" << hostname;
+            continue;
+        }
+        Request request = i.value();
+        inFlight.erase(i);
+
+        response.replace(0, 2, request.dns.req.left(2)); //The client's own id again
+        qDebug() << "Received DoTLS response:" << response;
+        emit decryptedLookupDoneSendResponseNow(response, request.dns);
+    }
+    received.remove(0, pos);
+    flush();
+}
+
+void DoTConnection::disconnected()
+{
+    received.clear();
+
+    //Written but not answered, most likely the server closed the idle connection as they went out, they get one more try
+    for(Request &request : inFlight)
+    {
+        if(request.attempts++ == 0)
+            waiting.push_front(request);
+    }
+    inFlight.clear();
+    if(waiting.empty())
+        timeoutTimer.stop();
+    else
+        QTimer::singleShot(0, this, &DoTConnection::flush);
+}
+
+void DoTConnection::socketError(QAbstractSocket::SocketError error)
+{
+    qDebug() << "DoT connection to:" << hostname << "error:" << error << tls.errorString();
+    //Couldn't even get connected, nothing waiting on it is going anywhere
+    if(!tls.isEncrypted() && inFlight.isEmpty())
+    {
+        waiting.clear();
+        timeoutTimer.stop();
+    }
+}
+
+void DoTConnection::verifyError(const QSslError &error)
+{
+    qDebug() << "TLS Error:" << error.errorString();
+}
+
+void DoTConnection::checkTimeouts()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    bool timedOut = false;
+    for(const Request &request : inFlight)
+    {
+        if(now - request.sentAt > DOT_QUERY_TIMEOUT_MS)
+        {
+            timedOut = true;
+            break;
+        }
+    }
+    if(timedOut)
+    {
+        qDebug() << "DoT server:" << hostname << "stopped answering, dropping the connection";
+        inFlight.clear(); //Clients are answered by their own timeout (or stale data) instead
+        tls.abort();
+    }
+    if(inFlight.isEmpty() && waiting.empty())
+        timeoutTimer.stop();
+}
+
+void DoTConnection::sessionTicketReceived()
+{
+    TlsSessionCache::remember(tls.sslConfiguration(), hostname);
+}
@@ -0,0 +1,186 @@
+#ifndef UPSTREAMCONNECTIONS_H
+#define UPSTREAMCONNECTIONS_H
+
+#include <QSslSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QDateTime>
+#include <QAtomicInteger>
+#include <QtEndian>
+#include <QMutex>
+#include <deque>
+#include "dnsinfo.h"
+#include "http2client.h"
+#include "httpresponseparser.h"
+#include "bootstrapresolver.h"
+
+/* YourFriendlyDNS - A really awesome multi-platform (lin,win,mac,android) local caching and proxying dns server!
+Copyright (C) 2018  softwareengineer1 @ github.com/softwareengineer1
+Support my work by sending me some Bitcoin or Bitcoin Cash in the value of what you valued one or more of my software projects,
+so I can keep bringing you great free and open software and continue to do so for a long time!
+I'm going entirely 100% free software this year in 2018 (and onwards I want to) :)
+Everything I make will be released under a free software license! That's my promise!
+If you want to contact me another way besides through github, insert your message into the blockchain with a BCH/BTC UTXO! ^_^
+Thank you for your support!
+BCH: bitcoincash:qzh3knl0xeyrzrxm5paenewsmkm8r4t76glzxmzpqs
+BTC: 1279WngWQUTV56UcTvzVAnNdR3Z7qb6R8j
+(These are the payment methods I currently accept,
+if you want to support me via another cryptocurrency let me know and I'll probably start accepting that one too)
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#define DOH_POOL_SIZE 4 //Connections per DoH provider
+#define DOH_MAX_PIPELINE 16 //Requests written ahead on one connection, once the server's shown it keeps connections open
+#define DOH_QUERY_TIMEOUT_MS 10000
+#define DOT_MAX_IN_FLIGHT 128 //Queries written ahead on a DoT connection, the rest wait their turn
+#define DOT_QUERY_TIMEOUT_MS 10000
+#define TLS_TICKET_DEFAULT_LIFETIME_SECS 3600 //When the server doesn't give a lifetime hint
+
+class UpstreamStats
+{
+public:
+    UpstreamStats() { dohQueries = dohHandshakes = dohHttp2Connections = dotQueries = dotHandshakes = tlsFullHandshakes = tlsTicketHandshakes = 0; }
+    double dohHandshakesPerQuery() const { return dohQueries ? (double)dohHandshakes / (double)dohQueries : 0.0; }
+    static UpstreamStats current();
+    static void countDoHQuery();
+    static void countDoHHandshake();
+    static void countDoHHttp2Connection();
+    static void countDoTQuery();
+    static void countDoTHandshake();
+    static void countTlsHandshake(bool offeredTicket);
+
+    quint64 dohQueries, dohHandshakes, dohHttp2Connections, dotQueries, dotHandshakes;
+    quint64 tlsFullHandshakes, tlsTicketHandshakes; //Whether a session ticket was offered, the server falls back to a full handshake itself if it won't take it
+};
+
+//TLS session tickets by provider hostname, shared by every upstream connection on every thread,
+//so reconnecting after the server's closed an idle connection resumes the session instead of doing the whole handshake again
+class TlsSessionCache
+{
+public:
+    static bool offer(QSslConfiguration &config, const QString &hostname);
+    static void remember(const QSslConfiguration &config, const QString &hostname);
+};
+
+//One long lived TLS connection to a DoH provider. When the server picks h2 in ALPN every query is its own HTTP/2 stream and they're all
+//out at once, answered in any order. Otherwise queries go out as HTTP/1.1 keep-alive POSTs and answers come back in the order they were sent,
+//starting with one request at a time and pipelining once the server's answered without closing, unless pipelining ever lost requests on it.
+//When the server closes it (usually after it's been idle a while), it's reconnected the next time there's something to send,
+//and requests that were written but not answered go out once more on the new connection.
+class DoHConnection : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DoHConnection(QString hostname, QString path, QHostAddress server, quint16 port, QString userAgent, QObject *parent = nullptr);
+    void query(const DNSInfo &dns);
+    ~DoHConnection();
+    int outstanding() const { return (int)(waiting.size() + inFlight.size()) + streams.size(); }
+    bool busy() const { return outstanding() >= maxInFlight(); }
+
+private:
+    struct Request
+    {
+        DNSInfo dns;
+        qint64 sentAt;
+        int attempts;
+        bool pipelined; //Written while another was still waiting on its answer
+    };
+
+    int maxInFlight() const;
+    void connectNow();
+    bool readResponse();
+    void respond(int status, const QByteArray &body);
+    void readHttp2();
+
+    QSslSocket tls;
+    QString hostname, path, userAgent;
+    QHostAddress server, connectedAddress;
+    quint16 port;
+    QByteArray requestHead; //Everything but the Content-Length value and the body, it's the same for every request
+    std::deque<Request> waiting, inFlight;
+    QByteArray received;
+    HttpResponseParser parser;
+    int parsed; //How much of received the parser's already been through
+    bool pipelining, pipeliningFailed;
+    int pipelinedAnswers; //Answers to requests written behind another still in flight, since connecting
+    Http2Client *http2; //Only while connected with h2
+    QHash<quint32, Request> streams; //HTTP/2 requests by stream id
+    bool http2Failed; //It broke the protocol once, it's HTTP/1.1 only from then on
+    bool offeredTicket;
+    QTimer timeoutTimer;
+
+signals:
+    void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
+
+private slots:
+    void flush();
+    void startEncryption();
+    void encrypted();
+    void readResponses();
+    void disconnected();
+    void socketError(QAbstractSocket::SocketError error);
+    void verifyError(const QSslError &error);
+    void checkTimeouts();
+    void sessionTicketReceived();
+};
+
+//One long lived TLS connection to a DoT provider (RFC 7858), queries are written back to back without waiting on each other.
+//Every query goes out under an id of its own on this connection, so answers can come back in any order and are matched by it,
+//then given the client's id back. Messages are reassembled from the 2 byte length prefix, however the TLS records happen to split them.
+class DoTConnection : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DoTConnection(QString hostname, QHostAddress server, quint16 port, QObject *parent = nullptr);
+    void query(const DNSInfo &dns);
+    int outstanding() const { return (int)waiting.size() + inFlight.size(); }
+
+private:
+    struct Request
+    {
+        DNSInfo dns;
+        qint64 sentAt;
+        int attempts;
+    };
+
+    void connectNow();
+    quint16 nextWireId();
+
+    QSslSocket tls;
+    QString hostname;
+    QHostAddress server, connectedAddress;
+    quint16 port, wireId;
+    std::deque<Request> waiting;
+    QHash<quint16, Request> inFlight; //By the id it went out with
+    QByteArray received;
+    QTimer timeoutTimer;
+    bool offeredTicket;
+
+signals:
+    void decryptedLookupDoneSendResponseNow(QByteArray response, DNSInfo &dns);
+
+private slots:
+    void flush();
+    void startEncryption();
+    void encrypted();
+    void readResponses();
+    void disconnected();
+    void socketError(QAbstractSocket::SocketError error);
+    void verifyError(const QSslError &error);
+    void checkTimeouts();
+    void sessionTicketReceived();
+};
+
+#endif // UPSTREAMCONNECTIONS_H